@@ -0,0 +1,160 @@
+#include "arena.h"
+
+#include <atomic>
+#include <new>
+
+static std::atomic<uint64_t> allocations(0);
+
+// every new and new[] of the program ends up here (the array and nothrow forms call it)
+void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void* memory = malloc(size == 0 ? 1 : size);
+    if (memory == NULL) {
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+// the nothrow form is replaced too so it cannot come from another allocator than the delete below
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return malloc(size == 0 ? 1 : size);
+}
+
+// replaced together with new so both sides agree on malloc and free, the array forms call these
+void operator delete(void* memory) noexcept {
+    free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+    free(memory);
+}
+
+void* counted_malloc(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return malloc(size);
+}
+
+void* counted_aligned_alloc(size_t alignment, size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return aligned_alloc(alignment, size);
+}
+
+uint64_t allocation_count() {
+    return allocations.load(std::memory_order_relaxed);
+}
+
+void arena_init(arena* pool, size_t chunk_size) {
+    pool->chunks.clear();
+    pool->chunk_size = chunk_size;
+    pool->current = 0;
+    pool->used = 0;
+}
+
+void* arena_alloc(arena* pool, size_t size, size_t alignment) {
+    while (pool->current < pool->chunks.size()) {
+        arena_chunk* chunk = &pool->chunks[pool->current];
+        size_t start = (pool->used + alignment - 1) & ~(alignment - 1);
+        if (start + size <= chunk->size) {
+            pool->used = start + size;
+            return chunk->data + start;
+        }
+        // the rest of this chunk stays unused until the arena is rolled back
+        pool->current++;
+        pool->used = 0;
+    }
+    // chunks are at least 16 byte aligned from new[], larger alignments are not asked for
+    arena_chunk chunk;
+    chunk.size = size > pool->chunk_size ? size : pool->chunk_size;
+    chunk.data = new uint8_t[chunk.size];
+    pool->chunks.push_back(chunk);
+    pool->current = pool->chunks.size() - 1;
+    pool->used = size;
+    return chunk.data;
+}
+
+arena_mark arena_save(arena* pool) {
+    return { pool->current, pool->used };
+}
+
+void arena_restore(arena* pool, arena_mark mark) {
+    pool->current = mark.chunk;
+    pool->used = mark.used;
+}
+
+void arena_reset(arena* pool) {
+    pool->current = 0;
+    pool->used = 0;
+}
+
+void arena_free(arena* pool) {
+    for (arena_chunk& chunk : pool->chunks) {
+        delete[] chunk.data;
+    }
+    pool->chunks.clear();
+    pool->current = 0;
+    pool->used = 0;
+}
+
+// buffers are carved out of chunks of this many buffers
+#define BUFFER_POOL_CHUNK_BUFFERS 64
+
+void buffer_pool_init(buffer_pool* pool, size_t buffer_size) {
+    arena_init(&pool->backing, buffer_size * BUFFER_POOL_CHUNK_BUFFERS);
+    pool->buffer_size = buffer_size;
+    pool->available.clear();
+}
+
+uint8_t* buffer_pool_get(buffer_pool* pool) {
+    if (pool->available.empty()) {
+        return (uint8_t*)arena_alloc(&pool->backing, pool->buffer_size);
+    }
+    uint8_t* buffer = pool->available.back();
+    pool->available.pop_back();
+    return buffer;
+}
+
+void buffer_pool_put(buffer_pool* pool, uint8_t* buffer) {
+    pool->available.push_back(buffer);
+}
+
+void buffer_pool_free(buffer_pool* pool) {
+    arena_free(&pool->backing);
+    pool->available.clear();
+    pool->available.shrink_to_fit();
+    pool->buffer_size = 0;
+}
+
+// pools of the calling thread, one per buffer size, freed when the thread ends
+// a pool is never freed before that so buffers still out stay valid when another size is asked for
+struct thread_buffers {
+    std::vector<buffer_pool*> pools;
+    ~thread_buffers() {
+        for (size_t i = 0; i < pools.size(); i++) {
+            buffer_pool_free(pools[i]);
+            delete pools[i];
+        }
+    }
+};
+
+static thread_local thread_buffers local_buffers;
+
+static buffer_pool* thread_pool(size_t size) {
+    for (size_t i = 0; i < local_buffers.pools.size(); i++) {
+        if (local_buffers.pools[i]->buffer_size == size) {
+            return local_buffers.pools[i];
+        }
+    }
+    buffer_pool* pool = new buffer_pool;
+    buffer_pool_init(pool, size);
+    local_buffers.pools.push_back(pool);
+    return pool;
+}
+
+uint8_t* thread_buffer_get(size_t size) {
+    return buffer_pool_get(thread_pool(size));
+}
+
+void thread_buffer_put(uint8_t* buffer, size_t size) {
+    buffer_pool_put(thread_pool(size), buffer);
+}
@@ -0,0 +1,76 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <vector>
+
+// bump allocator for the temporaries of one pass
+// memory comes from large chunks that are kept when the arena is reset or rolled back to a mark,
+// so after the first few inodes or blocks a pass allocates nothing from the heap
+struct arena_chunk {
+    uint8_t* data;
+    size_t size;
+};
+
+struct arena {
+    std::vector<arena_chunk> chunks;
+    size_t chunk_size; // size of a regular chunk, larger requests get a chunk of their own
+    size_t current; // chunk allocations are served from
+    size_t used; // bytes used in that chunk
+};
+
+// position to roll back to, everything allocated after it is released at once
+struct arena_mark {
+    size_t chunk;
+    size_t used;
+};
+
+void arena_init(arena* pool, size_t chunk_size);
+
+// size bytes aligned to alignment (a power of two), never NULL
+void* arena_alloc(arena* pool, size_t size, size_t alignment = 16);
+
+arena_mark arena_save(arena* pool);
+
+void arena_restore(arena* pool, arena_mark mark);
+
+// releases every allocation but keeps the chunks for the next pass
+void arena_reset(arena* pool);
+
+void arena_free(arena* pool);
+
+// fixed size buffers (one block each) handed out and taken back,
+// a returned buffer is reused by the next get instead of going back to the heap
+struct buffer_pool {
+    arena backing;
+    size_t buffer_size;
+    std::vector<uint8_t*> available;
+};
+
+void buffer_pool_init(buffer_pool* pool, size_t buffer_size);
+
+uint8_t* buffer_pool_get(buffer_pool* pool);
+
+void buffer_pool_put(buffer_pool* pool, uint8_t* buffer);
+
+// also releases buffers that were not put back
+void buffer_pool_free(buffer_pool* pool);
+
+// one block buffer from a pool of the calling thread, given back with thread_buffer_put on the same thread
+// there is one pool per size, made on first use (an image with another block size gets its own)
+uint8_t* thread_buffer_get(size_t size);
+
+// size is the one the buffer was taken with
+void thread_buffer_put(uint8_t* buffer, size_t size);
+
+// malloc and aligned_alloc that show up in allocation_count, the memory is released with free
+void* counted_malloc(size_t size);
+
+void* counted_aligned_alloc(size_t alignment, size_t size);
+
+// heap allocations of the whole process so far, the stats report shows them per phase:
+// every operator new (so also the nodes and arrays of std containers) and the counted_ calls above
+uint64_t allocation_count();
+
+#endif // ARENA_H
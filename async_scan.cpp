@@ -0,0 +1,408 @@
+#include "async_scan.h"
+#include "thread_pool.h"
+#include "stats.h"
+#include "arena.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+// there is no liburing here, the rings are set up with the raw system calls
+struct uring {
+    int fd;
+    unsigned int entries;
+    // submission ring
+    void* sq_map;
+    size_t sq_map_size;
+    unsigned int* sq_head;
+    unsigned int* sq_tail;
+    unsigned int* sq_mask;
+    unsigned int* sq_array;
+    io_uring_sqe* sqes;
+    // completion ring
+    void* cq_map;
+    size_t cq_map_size;
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    unsigned int* cq_mask;
+    io_uring_cqe* cqes;
+};
+
+static void uring_exit(uring* ring) {
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->entries * sizeof(io_uring_sqe));
+    }
+    if (ring->cq_map != NULL and ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    if (ring->sq_map != NULL) {
+        munmap(ring->sq_map, ring->sq_map_size);
+    }
+    close(ring->fd);
+}
+
+static bool uring_init(uring* ring, unsigned int entries) {
+    memset(ring, 0, sizeof(*ring));
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return false;
+    }
+    ring->entries = params.sq_entries;
+
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    // newer kernels map both rings with one call
+    bool single_map = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_map and ring->cq_map_size > ring->sq_map_size) {
+        ring->sq_map_size = ring->cq_map_size;
+    }
+
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        ring->sq_map = NULL;
+        uring_exit(ring);
+        return false;
+    }
+    if (single_map) {
+        ring->cq_map = ring->sq_map;
+    }
+    else {
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) {
+            ring->cq_map = NULL;
+            uring_exit(ring);
+            return false;
+        }
+    }
+    void* sqes = mmap(NULL, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        uring_exit(ring);
+        return false;
+    }
+    ring->sqes = (io_uring_sqe*)sqes;
+
+    uint8_t* sq = (uint8_t*)ring->sq_map;
+    ring->sq_head = (unsigned int*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int*)(sq + params.sq_off.array);
+    uint8_t* cq = (uint8_t*)ring->cq_map;
+    ring->cq_head = (unsigned int*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+    return true;
+}
+
+// queues a readv of iov at offset, the kernel sees it on the next uring_enter
+static void uring_queue_read(uring* ring, int fd, const iovec* iov, uint64_t offset, uint64_t user_data) {
+    unsigned int tail = *ring->sq_tail;
+    unsigned int index = tail & *ring->sq_mask;
+    io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV; // READV is there since the first io_uring kernels
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)iov;
+    sqe->len = 1;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int uring_enter(uring* ring, unsigned int submit, unsigned int wait) {
+    while (true) {
+        int result = syscall(__NR_io_uring_enter, ring->fd, submit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        stats_add(STATS_URING_ENTERS, 1);
+        if (result >= 0 or errno != EINTR) {
+            return result;
+        }
+    }
+}
+
+bool async_scan_uring_available() {
+    uring ring;
+    if (!uring_init(&ring, 1)) {
+        return false;
+    }
+    uring_exit(&ring);
+    return true;
+}
+
+// the aligned read that covers a request
+struct scan_read {
+    uint64_t offset;
+    size_t length;
+    size_t skip; // where the request starts inside the read
+};
+
+static scan_read aligned_read(const scan_request& request, bool direct) {
+    if (!direct) {
+        return { request.offset, request.length, 0 };
+    }
+    uint64_t start = request.offset / SCAN_DIRECT_ALIGNMENT * SCAN_DIRECT_ALIGNMENT;
+    uint64_t end = (request.offset + request.length + SCAN_DIRECT_ALIGNMENT - 1) / SCAN_DIRECT_ALIGNMENT * SCAN_DIRECT_ALIGNMENT;
+    return { start, (size_t)(end - start), (size_t)(request.offset - start) };
+}
+
+static uint8_t* alloc_buffer(size_t size) {
+    size = (size + SCAN_DIRECT_ALIGNMENT - 1) / SCAN_DIRECT_ALIGNMENT * SCAN_DIRECT_ALIGNMENT;
+    uint8_t* buffer = (uint8_t*)counted_aligned_alloc(SCAN_DIRECT_ALIGNMENT, size);
+    if (buffer == NULL) {
+        printf("Error: failed to allocate scan buffer\n");
+    }
+    return buffer;
+}
+
+// completes a read that stopped after got bytes, short reads of regular files only happen at the end
+// an O_DIRECT read past an unaligned end of file cannot be retried, so there the rest is zeros right away
+static bool finish_read(int fd, uint8_t* buffer, size_t length, uint64_t offset, size_t got, bool direct) {
+    if (direct and got < length) {
+        memset(buffer + got, 0, length - got);
+        return true;
+    }
+    while (got < length) {
+        ssize_t result = pread(fd, buffer + got, length - got, offset + got);
+        stats_add(STATS_READ_CALLS, 1);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (result == 0) { // end of file
+            memset(buffer + got, 0, length - got);
+            break;
+        }
+        stats_add(STATS_BYTES_READ, result);
+        got += result;
+    }
+    return true;
+}
+
+static size_t largest_read(const std::vector<scan_request>& requests, bool direct) {
+    size_t largest = 0;
+    for (const scan_request& request : requests) {
+        size_t length = aligned_read(request, direct).length;
+        largest = length > largest ? length : largest;
+    }
+    return largest;
+}
+
+// completed reads waiting for a consumer, shared by the thread driving the ring and the consumer threads
+struct scan_handoff {
+    std::mutex lock;
+    std::condition_variable changed; // a read completed, a slot came back or the scan ended
+    std::vector<unsigned int> completed;
+    std::vector<unsigned int> free_slots;
+    bool done;
+};
+
+// one thread keeps depth reads in flight and reaps them, consumer_count threads inspect the buffers,
+// with no consumer threads the reaping thread consumes each buffer itself
+static bool uring_scan(uring* ring, int fd, const std::vector<scan_request>& requests, unsigned int depth, unsigned int consumer_count, bool direct, const scan_consumer& consume) {
+    if (depth > ring->entries) {
+        depth = ring->entries;
+    }
+    // a slot is either reading or being consumed, the extra ones keep the ring full meanwhile
+    unsigned int slot_count = depth + consumer_count;
+    size_t buffer_size = largest_read(requests, direct);
+    std::vector<uint8_t*> buffers(slot_count);
+    std::vector<iovec> iov(slot_count);
+    scan_handoff handoff;
+    handoff.done = false;
+    for (unsigned int i = 0; i < slot_count; i++) {
+        buffers[i] = alloc_buffer(buffer_size);
+        if (buffers[i] == NULL) {
+            for (unsigned int j = 0; j < i; j++) {
+                free(buffers[j]);
+            }
+            return false;
+        }
+        handoff.free_slots.push_back(i);
+    }
+    std::vector<size_t> slot_request(slot_count);
+    std::atomic<bool> ok(true);
+
+    auto consume_slot = [&](unsigned int slot) {
+        scan_read read = aligned_read(requests[slot_request[slot]], direct);
+        consume(slot_request[slot], buffers[slot] + read.skip);
+        std::lock_guard<std::mutex> guard(handoff.lock);
+        handoff.free_slots.push_back(slot);
+        handoff.changed.notify_all();
+    };
+
+    auto drive_ring = [&]() {
+        size_t next = 0;
+        unsigned int in_flight = 0;
+        while (ok and (next < requests.size() or in_flight > 0)) {
+            // keep every slot busy, wait for a consumer if all of them are
+            unsigned int queued = 0;
+            {
+                std::unique_lock<std::mutex> guard(handoff.lock);
+                while (in_flight == 0 and handoff.free_slots.empty()) {
+                    handoff.changed.wait(guard);
+                }
+                while (!handoff.free_slots.empty() and next < requests.size() and in_flight + queued < depth) {
+                    unsigned int slot = handoff.free_slots.back();
+                    handoff.free_slots.pop_back();
+                    scan_read read = aligned_read(requests[next], direct);
+                    slot_request[slot] = next;
+                    iov[slot].iov_base = buffers[slot];
+                    iov[slot].iov_len = read.length;
+                    uring_queue_read(ring, fd, &iov[slot], read.offset, slot);
+                    next++;
+                    queued++;
+                }
+            }
+            in_flight += queued;
+            if (in_flight == 0) {
+                continue;
+            }
+            if (uring_enter(ring, queued, 1) < 0) {
+                ok = false;
+                break;
+            }
+
+            // hand over what completed, the other reads keep going meanwhile
+            unsigned int head = *ring->cq_head;
+            while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+                io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+                unsigned int slot = cqe->user_data;
+                int result = cqe->res;
+                head++;
+                __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+                in_flight--;
+
+                scan_read read = aligned_read(requests[slot_request[slot]], direct);
+                stats_add(STATS_URING_READS, 1);
+                stats_add(STATS_URING_BYTES, result > 0 ? result : 0);
+                if (result < 0 or !finish_read(fd, buffers[slot], read.length, read.offset, result, direct)) {
+                    printf("Error: failed to read %lu bytes at %lu\n", (unsigned long)read.length, (unsigned long)read.offset);
+                    ok = false;
+                    std::lock_guard<std::mutex> guard(handoff.lock);
+                    handoff.free_slots.push_back(slot);
+                }
+                else if (consumer_count == 0) {
+                    consume_slot(slot);
+                }
+                else {
+                    std::lock_guard<std::mutex> guard(handoff.lock);
+                    handoff.completed.push_back(slot);
+                    handoff.changed.notify_all();
+                }
+            }
+        }
+
+        // the kernel may still write into the buffers of reads given up on
+        while (in_flight > 0 and uring_enter(ring, 0, in_flight) >= 0) {
+            unsigned int head = *ring->cq_head;
+            unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+            in_flight -= tail - head;
+            __atomic_store_n(ring->cq_head, tail, __ATOMIC_RELEASE);
+        }
+        std::lock_guard<std::mutex> guard(handoff.lock);
+        handoff.done = true;
+        handoff.changed.notify_all();
+    };
+
+    if (consumer_count == 0) {
+        drive_ring();
+    }
+    else {
+        // task 0 drives the ring, the others consume until it is done and nothing is left
+        run_parallel(consumer_count + 1, consumer_count + 1, [&](size_t task) {
+            if (task == 0) {
+                drive_ring();
+                return;
+            }
+            std::unique_lock<std::mutex> guard(handoff.lock);
+            while (true) {
+                while (handoff.completed.empty() and !handoff.done) {
+                    handoff.changed.wait(guard);
+                }
+                if (handoff.completed.empty()) {
+                    return;
+                }
+                unsigned int slot = handoff.completed.back();
+                handoff.completed.pop_back();
+                guard.unlock();
+                consume_slot(slot);
+                guard.lock();
+            }
+        });
+    }
+
+    for (uint8_t* buffer : buffers) {
+        free(buffer);
+    }
+    return ok;
+}
+
+static bool pread_scan(int fd, const std::vector<scan_request>& requests, unsigned int depth, bool direct, const scan_consumer& consume) {
+    if (depth > requests.size()) {
+        depth = requests.size();
+    }
+    size_t buffer_size = largest_read(requests, direct);
+    std::atomic<bool> ok(true);
+    std::atomic<size_t> next(0);
+    // one worker per read in flight, each reads and consumes its own chunks into one buffer of its own
+    run_parallel(depth, depth, [&](size_t) {
+        uint8_t* buffer = alloc_buffer(buffer_size);
+        if (buffer == NULL) {
+            ok = false;
+            return;
+        }
+        size_t i;
+        while (ok and (i = next.fetch_add(1)) < requests.size()) {
+            scan_read read = aligned_read(requests[i], direct);
+            // a plain pread may stop early, an O_DIRECT one only at the end of the file
+            ssize_t got = 0;
+            if (direct) {
+                got = pread(fd, buffer, read.length, read.offset);
+                stats_add(STATS_READ_CALLS, 1);
+                stats_add(STATS_BYTES_READ, got > 0 ? got : 0);
+            }
+            if (got >= 0 and finish_read(fd, buffer, read.length, read.offset, got, direct)) {
+                consume(i, buffer + read.skip);
+            }
+            else {
+                printf("Error: failed to read %lu bytes at %lu\n", (unsigned long)read.length, (unsigned long)read.offset);
+                ok = false;
+            }
+        }
+        free(buffer);
+    });
+    return ok;
+}
+
+bool async_scan(int fd, const std::vector<scan_request>& requests, unsigned int depth, unsigned int thread_count, scan_engine_kind kind, bool direct, const scan_consumer& consume) {
+    if (requests.empty()) {
+        return true;
+    }
+    if (depth == 0) {
+        depth = 1;
+    }
+    if (kind != SCAN_ENGINE_PREAD) {
+        uring ring;
+        if (uring_init(&ring, depth)) {
+            bool ok = uring_scan(&ring, fd, requests, depth, thread_count > 1 ? thread_count : 0, direct, consume);
+            uring_exit(&ring);
+            return ok;
+        }
+        if (kind == SCAN_ENGINE_URING) {
+            fprintf(stderr, "io_uring is not available, using pread\n");
+        }
+    }
+    return pread_scan(fd, requests, depth, direct, consume);
+}
@@ -0,0 +1,44 @@
+#ifndef ASYNC_SCAN_H
+#define ASYNC_SCAN_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <functional>
+#include <vector>
+
+// asynchronous read pipeline for whole image scans
+// keeps depth large reads in flight and hands each completed buffer to a consumer,
+// so the device reads the next chunks while the current one is inspected
+enum scan_engine_kind {
+    SCAN_ENGINE_AUTO, // io_uring if the kernel has it, pread workers otherwise
+    SCAN_ENGINE_URING,
+    SCAN_ENGINE_PREAD,
+};
+
+#define SCAN_DEFAULT_DEPTH 16
+
+// reads of an O_DIRECT descriptor start and end on this boundary, which also covers 512 byte devices
+#define SCAN_DIRECT_ALIGNMENT 4096
+
+// bytes per read of a direct scan, larger than a cached one since there is no readahead behind it
+#define DIRECT_SCAN_CHUNK_SIZE (4U << 20)
+
+struct scan_request {
+    uint64_t offset;
+    size_t length;
+};
+
+// called once per request with its bytes, whatever lies past the end of the file reads as zeros
+// calls run concurrently: with io_uring on thread_count threads while one more thread keeps the reads going
+// (all on the calling thread if thread_count is 1), with pread on the depth workers
+typedef std::function<void(size_t request, uint8_t* data)> scan_consumer;
+
+// reads every request from fd, returns false on a read error
+// with direct set fd is opened O_DIRECT: every read is widened to SCAN_DIRECT_ALIGNMENT and lands in
+// an aligned buffer, the consumer still gets exactly the requested bytes
+bool async_scan(int fd, const std::vector<scan_request>& requests, unsigned int depth, unsigned int thread_count, scan_engine_kind kind, bool direct, const scan_consumer& consume);
+
+// true if io_uring can be set up here
+bool async_scan_uring_available();
+
+#endif // ASYNC_SCAN_H
@@ -0,0 +1,206 @@
+#include "bitmap.h"
+
+#include <stdio.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BITMAP_X86
+#endif
+
+bool bitmap_init(bitmap* map, uint64_t bit_count, size_t byte_size) {
+    uint64_t bytes = (bit_count + 7) / 8 > byte_size ? (bit_count + 7) / 8 : byte_size;
+    map->word_count = (bytes + 7) / 8;
+    map->bit_count = bit_count;
+    map->words = new uint64_t[map->word_count == 0 ? 1 : map->word_count]();
+    if (map->words == NULL) {
+        printf("Error: failed to allocate a bitmap of %lu bits\n", (unsigned long)bit_count);
+        return false;
+    }
+    return true;
+}
+
+void bitmap_free(bitmap* map) {
+    delete[] map->words;
+    map->words = NULL;
+    map->word_count = 0;
+    map->bit_count = 0;
+}
+
+// mask of bits [first, first + count) inside one word, count in [1, 64]
+static inline uint64_t word_mask(uint64_t first, uint64_t count) {
+    uint64_t mask = count == 64 ? ~0ULL : (1ULL << count) - 1;
+    return mask << first;
+}
+
+void bitmap_set_range(bitmap* map, uint64_t first, uint64_t count) {
+    while (count > 0) {
+        uint64_t shift = first % 64;
+        uint64_t take = 64 - shift < count ? 64 - shift : count;
+        map->words[first / 64] |= word_mask(shift, take);
+        first += take;
+        count -= take;
+    }
+}
+
+typedef uint64_t (*popcount_kernel)(const uint64_t* words, size_t count);
+
+// builds to a bit trick sequence without -mpopcnt
+static uint64_t popcount_generic(const uint64_t* words, size_t count) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        total += __builtin_popcountll(words[i]);
+    }
+    return total;
+}
+
+#ifdef BITMAP_X86
+__attribute__((target("popcnt")))
+static uint64_t popcount_hardware(const uint64_t* words, size_t count) {
+    // four independent sums keep several popcnt in flight
+    uint64_t a = 0, b = 0, c = 0, d = 0;
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        a += __builtin_popcountll(words[i]);
+        b += __builtin_popcountll(words[i + 1]);
+        c += __builtin_popcountll(words[i + 2]);
+        d += __builtin_popcountll(words[i + 3]);
+    }
+    for (; i < count; i++) {
+        a += __builtin_popcountll(words[i]);
+    }
+    return a + b + c + d;
+}
+#endif
+
+struct popcount_choice {
+    popcount_kernel kernel;
+    const char* name;
+};
+
+static popcount_choice pick_popcount() {
+#ifdef BITMAP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("popcnt")) {
+        return { popcount_hardware, "popcnt" };
+    }
+#endif
+    return { popcount_generic, "generic" };
+}
+
+static const popcount_choice& popcount_selected() {
+    static const popcount_choice choice = pick_popcount();
+    return choice;
+}
+
+const char* bitmap_popcount_name() {
+    return popcount_selected().name;
+}
+
+uint64_t bitmap_count(const bitmap* map, uint64_t first, uint64_t count) {
+    uint64_t total = 0;
+    // partial first word
+    if (count > 0 and first % 64 != 0) {
+        uint64_t take = 64 - first % 64 < count ? 64 - first % 64 : count;
+        total += __builtin_popcountll(map->words[first / 64] & word_mask(first % 64, take));
+        first += take;
+        count -= take;
+    }
+    // whole words
+    total += popcount_selected().kernel(map->words + first / 64, count / 64);
+    first += count / 64 * 64;
+    count %= 64;
+    if (count > 0) {
+        total += __builtin_popcountll(map->words[first / 64] & word_mask(0, count));
+    }
+    return total;
+}
+
+// first bit at or after from whose value (xored with invert) is 1
+static uint64_t find_next(const bitmap* map, uint64_t from, uint64_t invert) {
+    if (from >= map->bit_count) {
+        return BITMAP_NONE;
+    }
+    size_t index = from / 64;
+    uint64_t word = (map->words[index] ^ invert) & (~0ULL << (from % 64));
+    size_t last = (map->bit_count - 1) / 64;
+    while (word == 0) {
+        if (++index > last) {
+            return BITMAP_NONE;
+        }
+        word = map->words[index] ^ invert;
+    }
+    uint64_t bit = (uint64_t)index * 64 + __builtin_ctzll(word);
+    return bit < map->bit_count ? bit : BITMAP_NONE;
+}
+
+uint64_t bitmap_find_next_set(const bitmap* map, uint64_t from) {
+    return find_next(map, from, 0);
+}
+
+uint64_t bitmap_find_next_zero(const bitmap* map, uint64_t from) {
+    return find_next(map, from, ~0ULL);
+}
+
+// the 64 bits starting at bit first, zeros past the storage
+static inline uint64_t load_bits(const bitmap* map, uint64_t first) {
+    size_t index = first / 64;
+    uint64_t shift = first % 64;
+    uint64_t low = map->words[index] >> shift;
+    if (shift == 0 or index + 1 >= map->word_count) {
+        return low;
+    }
+    return low | map->words[index + 1] << (64 - shift);
+}
+
+void bitmap_or_range(bitmap* into, uint64_t into_first, const bitmap* from, uint64_t from_first, uint64_t count) {
+    while (count > 0) {
+        // fill up to the next word boundary of the target, then whole words
+        uint64_t shift = into_first % 64;
+        uint64_t take = 64 - shift < count ? 64 - shift : count;
+        uint64_t bits = load_bits(from, from_first) & word_mask(0, take);
+        into->words[into_first / 64] |= bits << shift;
+        into_first += take;
+        from_first += take;
+        count -= take;
+    }
+}
+
+uint64_t bitmap_diff(const bitmap* a, const bitmap* b, uint64_t count, const std::function<void(uint64_t, uint64_t)>& found) {
+    uint64_t differing = 0;
+    uint64_t run_start = 0;
+    bool in_run = false;
+    for (uint64_t first = 0; first < count; first += 64) {
+        uint64_t take = count - first < 64 ? count - first : 64;
+        uint64_t x = (a->words[first / 64] ^ b->words[first / 64]) & word_mask(0, take);
+        if (!in_run and x == 0) {
+            continue; // the common case, nothing differs in this word
+        }
+        differing += __builtin_popcountll(x);
+        // walk the edges of the runs inside the word
+        uint64_t bit = 0;
+        while (bit < take) {
+            uint64_t rest = x >> bit;
+            if (in_run) {
+                // run goes on until the first equal bit
+                uint64_t equal = ~rest & word_mask(0, take - bit);
+                if (equal == 0) {
+                    break;
+                }
+                bit += __builtin_ctzll(equal);
+                found(run_start, first + bit - run_start);
+                in_run = false;
+            }
+            else {
+                if (rest == 0) {
+                    break;
+                }
+                bit += __builtin_ctzll(rest);
+                run_start = first + bit;
+                in_run = true;
+            }
+        }
+    }
+    if (in_run) {
+        found(run_start, count - run_start);
+    }
+    return differing;
+}
@@ -0,0 +1,75 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <functional>
+
+// bitmap kept in 64 bit words, bit i is bit i % 64 of word i / 64
+// on a little endian machine that is exactly the ext2 on-disk layout (bit i is bit i % 8 of byte i / 8),
+// so a bitmap block is read into and written from bitmap_bytes directly
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "bitmap words are assumed to have the on-disk byte order"
+#endif
+
+struct bitmap {
+    uint64_t* words;
+    uint64_t bit_count; // bits in use, the storage may be larger
+    size_t word_count;
+};
+
+#define BITMAP_NONE UINT64_MAX // returned by the searches when nothing is found
+
+// zeroed bitmap of bit_count bits whose storage holds at least byte_size bytes
+bool bitmap_init(bitmap* map, uint64_t bit_count, size_t byte_size = 0);
+
+void bitmap_free(bitmap* map);
+
+// the storage as on-disk bytes
+static inline uint8_t* bitmap_bytes(bitmap* map) {
+    return (uint8_t*)map->words;
+}
+
+static inline const uint8_t* bitmap_bytes(const bitmap* map) {
+    return (const uint8_t*)map->words;
+}
+
+static inline bool bitmap_test(const bitmap* map, uint64_t bit) {
+    return (map->words[bit / 64] >> (bit % 64)) & 1;
+}
+
+static inline void bitmap_set(bitmap* map, uint64_t bit) {
+    map->words[bit / 64] |= 1ULL << (bit % 64);
+}
+
+static inline void bitmap_clear(bitmap* map, uint64_t bit) {
+    map->words[bit / 64] &= ~(1ULL << (bit % 64));
+}
+
+// for bitmaps several threads set bits in
+static inline void bitmap_set_atomic(bitmap* map, uint64_t bit) {
+    __atomic_fetch_or(&map->words[bit / 64], 1ULL << (bit % 64), __ATOMIC_RELAXED);
+}
+
+// sets bits [first, first + count), the storage past bit_count can be set too (on-disk padding)
+void bitmap_set_range(bitmap* map, uint64_t first, uint64_t count);
+
+// set bits among [first, first + count)
+uint64_t bitmap_count(const bitmap* map, uint64_t first, uint64_t count);
+
+// first set (or zero) bit at or after from and below bit_count, BITMAP_NONE if there is none
+uint64_t bitmap_find_next_set(const bitmap* map, uint64_t from);
+
+uint64_t bitmap_find_next_zero(const bitmap* map, uint64_t from);
+
+// into[into_first + i] |= from[from_first + i] for i < count
+void bitmap_or_range(bitmap* into, uint64_t into_first, const bitmap* from, uint64_t from_first, uint64_t count);
+
+// calls found(first, count) for every run of bits in [0, count) that differ between a and b
+// returns the number of differing bits
+uint64_t bitmap_diff(const bitmap* a, const bitmap* b, uint64_t count, const std::function<void(uint64_t, uint64_t)>& found);
+
+// name of the popcount bitmap_count picked, for diagnostics
+const char* bitmap_popcount_name();
+
+#endif // BITMAP_H
@@ -0,0 +1,99 @@
+#include "bitmap_diff.h"
+#include "bitmap.h"
+#include "image.h"
+#include "reachability.h"
+
+#include <string.h>
+#include <vector>
+
+// one side of the comparison
+struct diff_side {
+    ext2_image* image;
+    ext2_super_block super_block;
+    std::vector<ext2_block_group_descriptor> bgdt;
+};
+
+static bool diff_side_open(diff_side* side, const char* path) {
+    side->image = image_open(path, false);
+    if (side->image == NULL) {
+        return false;
+    }
+    if (!image_read(side->image, EXT2_SUPER_BLOCK_POSITION, &side->super_block, sizeof(ext2_super_block)) or side->super_block.magic != EXT2_SUPER_MAGIC) {
+        printf("Error: %s is not an ext2 image\n", path);
+        return false;
+    }
+    uint32_t block_size = EXT2_UNLOG(side->super_block.log_block_size);
+    image_set_block_size(side->image, block_size);
+    unsigned int group_count = (side->super_block.inode_count + side->super_block.inodes_per_group - 1) / side->super_block.inodes_per_group;
+    side->bgdt.resize(group_count);
+    if (!image_read(side->image, ((uint64_t)side->super_block.first_data_block + 1) * block_size, side->bgdt.data(), group_count * sizeof(ext2_block_group_descriptor))) {
+        printf("Error: failed to read block group descriptor table of %s\n", path);
+        return false;
+    }
+    return true;
+}
+
+// prints the runs where the group's bitmaps differ and returns how many bits do
+// unit names the bits and first is the number of bit 0 (first inode or block of the group)
+static uint64_t diff_group(FILE* report, unsigned int group_num, const char* kind, const char* unit, uint64_t first, const bitmap* image_bits, const bitmap* reference_bits, uint64_t count) {
+    return bitmap_diff(image_bits, reference_bits, count, [&](uint64_t start, uint64_t length) {
+        // inside a run every bit set in the image is unset in the reference and the other way round
+        uint64_t extra = bitmap_count(image_bits, start, length);
+        if (length == 1) {
+            fprintf(report, "group %u %s bitmap: %s %lu differs (%s)\n", group_num, kind, unit, (unsigned long)(first + start), extra != 0 ? "extra" : "missing");
+        }
+        else {
+            fprintf(report, "group %u %s bitmap: %ss %lu-%lu differ (%lu missing, %lu extra)\n", group_num, kind, unit,
+                (unsigned long)(first + start), (unsigned long)(first + start + length - 1), (unsigned long)(length - extra), (unsigned long)extra);
+        }
+    });
+}
+
+int64_t diff_image_bitmaps(const char* image_path, const char* reference_path, FILE* report) {
+    diff_side sides[2] = {};
+    bool ok = diff_side_open(&sides[0], image_path) and diff_side_open(&sides[1], reference_path);
+    ext2_super_block* super_block = &sides[0].super_block;
+    ext2_super_block* reference = &sides[1].super_block;
+    if (ok and (super_block->log_block_size != reference->log_block_size or super_block->block_count != reference->block_count
+        or super_block->inode_count != reference->inode_count or super_block->blocks_per_group != reference->blocks_per_group
+        or super_block->inodes_per_group != reference->inodes_per_group or super_block->first_data_block != reference->first_data_block)) {
+        printf("Error: %s and %s have different geometry\n", image_path, reference_path);
+        ok = false;
+    }
+
+    int64_t differing = -1;
+    if (ok) {
+        uint32_t block_size = EXT2_UNLOG(super_block->log_block_size);
+        bitmap inode_bits[2];
+        bitmap block_bits[2];
+        for (int i = 0; i < 2; i++) {
+            bitmap_init(&inode_bits[i], super_block->inodes_per_group, block_size);
+            bitmap_init(&block_bits[i], super_block->blocks_per_group, block_size);
+        }
+        uint64_t inode_differing = 0;
+        uint64_t block_differing = 0;
+        for (unsigned int group_num = 0; group_num < sides[0].bgdt.size(); group_num++) {
+            for (int i = 0; i < 2; i++) {
+                image_read(sides[i].image, (uint64_t)sides[i].bgdt[group_num].inode_bitmap * block_size, bitmap_bytes(&inode_bits[i]), (super_block->inodes_per_group + 7) / 8);
+                image_read(sides[i].image, (uint64_t)sides[i].bgdt[group_num].block_bitmap * block_size, bitmap_bytes(&block_bits[i]), (super_block->blocks_per_group + 7) / 8);
+            }
+            inode_differing += diff_group(report, group_num, "inode", "inode", (uint64_t)group_num * super_block->inodes_per_group + 1,
+                &inode_bits[0], &inode_bits[1], super_block->inodes_per_group);
+            block_differing += diff_group(report, group_num, "block", "block", (uint64_t)group_num * super_block->blocks_per_group + super_block->first_data_block,
+                &block_bits[0], &block_bits[1], group_block_count(super_block, group_num));
+        }
+        for (int i = 0; i < 2; i++) {
+            bitmap_free(&inode_bits[i]);
+            bitmap_free(&block_bits[i]);
+        }
+        fprintf(report, "%lu inode and %lu block bits differ\n", (unsigned long)inode_differing, (unsigned long)block_differing);
+        differing = inode_differing + block_differing;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (sides[i].image != NULL) {
+            image_close(sides[i].image);
+        }
+    }
+    return differing;
+}
@@ -0,0 +1,13 @@
+#ifndef BITMAP_DIFF_H
+#define BITMAP_DIFF_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+// compares the inode and block bitmaps of image with the ones of reference, group by group,
+// and prints every run of differing inodes or blocks to report. only the real bits count, not the padding
+// returns the number of differing bits, -1 if the images cannot be read or have different geometry
+int64_t diff_image_bitmaps(const char* image_path, const char* reference_path, FILE* report);
+
+#endif // BITMAP_DIFF_H
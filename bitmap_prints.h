@@ -6,11 +6,12 @@
 #include <stdint.h>
 
 #include "ext2fs.h"
+#include "image.h"
 
-void print_inode_bitmap(FILE* file, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt);
+void print_inode_bitmap(ext2_image* image, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt);
 
-void print_block_bitmap(FILE* file, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt);
+void print_block_bitmap(ext2_image* image, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt);
 
-void print_all_bitmaps(FILE* file, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt, size_t group_count);
+void print_all_bitmaps(ext2_image* image, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt, size_t group_count);
 
 #endif  // BITMAP_PRINTS_H
\ No newline at end of file
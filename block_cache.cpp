@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "block_cache.h"
+#include "stats.h"
+
+#define NO_SLOT ((size_t)-1)
+
+block_cache* block_cache_create(uint32_t block_size, size_t budget) {
+    size_t capacity = budget / block_size;
+    if (capacity < BLOCK_CACHE_MIN_BLOCKS) {
+        capacity = BLOCK_CACHE_MIN_BLOCKS;
+    }
+
+    block_cache* cache = new block_cache;
+    cache->block_size = block_size;
+    cache->capacity = capacity;
+    cache->data = new uint8_t[capacity * block_size];
+    cache->block.resize(capacity);
+    cache->pins.assign(capacity, 0);
+    cache->loading.assign(capacity, 0);
+    cache->prev.assign(capacity, NO_SLOT);
+    cache->next.assign(capacity, NO_SLOT);
+    size_t entries = 1;
+    while (entries < capacity * 2) {
+        entries *= 2;
+    }
+    cache->table_block.assign(entries, 0);
+    cache->table_slot.assign(entries, NO_SLOT);
+    cache->table_mask = entries - 1;
+    cache->head = NO_SLOT;
+    cache->tail = NO_SLOT;
+    cache->used = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->evictions = 0;
+    return cache;
+}
+
+void block_cache_destroy(block_cache* cache) {
+    if (cache == NULL) {
+        return;
+    }
+    delete[] cache->data;
+    delete cache;
+}
+
+static void lru_unlink(block_cache* cache, size_t slot) {
+    if (cache->prev[slot] != NO_SLOT) {
+        cache->next[cache->prev[slot]] = cache->next[slot];
+    }
+    else {
+        cache->head = cache->next[slot];
+    }
+    if (cache->next[slot] != NO_SLOT) {
+        cache->prev[cache->next[slot]] = cache->prev[slot];
+    }
+    else {
+        cache->tail = cache->prev[slot];
+    }
+    cache->prev[slot] = NO_SLOT;
+    cache->next[slot] = NO_SLOT;
+}
+
+static void lru_push_front(block_cache* cache, size_t slot) {
+    cache->prev[slot] = NO_SLOT;
+    cache->next[slot] = cache->head;
+    if (cache->head != NO_SLOT) {
+        cache->prev[cache->head] = slot;
+    }
+    cache->head = slot;
+    if (cache->tail == NO_SLOT) {
+        cache->tail = slot;
+    }
+}
+
+static inline size_t table_home(block_cache* cache, uint32_t block_number) {
+    return ((uint64_t)block_number * 2654435761U) & cache->table_mask;
+}
+
+// table entry of the block, or the empty entry its probe ends at
+static size_t table_position(block_cache* cache, uint32_t block_number) {
+    size_t i = table_home(cache, block_number);
+    while (cache->table_slot[i] != NO_SLOT and cache->table_block[i] != block_number) {
+        i = (i + 1) & cache->table_mask;
+    }
+    return i;
+}
+
+static size_t table_find(block_cache* cache, uint32_t block_number) {
+    return cache->table_slot[table_position(cache, block_number)];
+}
+
+static void table_insert(block_cache* cache, uint32_t block_number, size_t slot) {
+    size_t i = table_position(cache, block_number);
+    cache->table_block[i] = block_number;
+    cache->table_slot[i] = slot;
+}
+
+static void table_erase(block_cache* cache, uint32_t block_number) {
+    size_t i = table_position(cache, block_number);
+    if (cache->table_slot[i] == NO_SLOT) {
+        return;
+    }
+    // shift later entries of the probe back into the hole so no lookup stops early
+    size_t j = i;
+    while (true) {
+        j = (j + 1) & cache->table_mask;
+        if (cache->table_slot[j] == NO_SLOT) {
+            break;
+        }
+        size_t home = table_home(cache, cache->table_block[j]);
+        // the entry may move to i unless its home lies cyclically in (i, j]
+        bool stays = i <= j ? (home > i and home <= j) : (home > i or home <= j);
+        if (!stays) {
+            cache->table_block[i] = cache->table_block[j];
+            cache->table_slot[i] = cache->table_slot[j];
+            i = j;
+        }
+    }
+    cache->table_slot[i] = NO_SLOT;
+}
+
+// a free slot, or the least recently used unpinned one, NO_SLOT if all are pinned
+// called with the lock held
+static size_t take_slot(block_cache* cache) {
+    if (!cache->free_slots.empty()) {
+        size_t slot = cache->free_slots.back();
+        cache->free_slots.pop_back();
+        return slot;
+    }
+    if (cache->used < cache->capacity) {
+        return cache->used++;
+    }
+    for (size_t slot = cache->tail; slot != NO_SLOT; slot = cache->prev[slot]) {
+        if (cache->pins[slot] == 0) {
+            lru_unlink(cache, slot);
+            table_erase(cache, cache->block[slot]);
+            cache->evictions++;
+            return slot;
+        }
+    }
+    return NO_SLOT;
+}
+
+// waits until the load of the slot ends, the lock is released meanwhile
+static void wait_loaded(block_cache* cache, std::unique_lock<std::mutex>& guard, size_t slot) {
+    cache->loaded[slot % BLOCK_CACHE_WAIT_STRIPES].wait(guard);
+}
+
+// slot holding the block, loaded on a miss, NO_SLOT on failure. called with the lock held,
+// which is given up while the block is read
+static size_t find_slot(block_cache* cache, std::unique_lock<std::mutex>& guard, uint32_t block_number, block_cache_loader load, void* context) {
+    size_t found;
+    while ((found = table_find(cache, block_number)) != NO_SLOT and cache->loading[found]) {
+        // looked up again afterwards, a failed load takes the block out of the table
+        wait_loaded(cache, guard, found);
+    }
+    if (found != NO_SLOT) {
+        cache->hits++;
+        stats_add(STATS_CACHE_HITS, 1);
+        lru_unlink(cache, found);
+        lru_push_front(cache, found);
+        return found;
+    }
+
+    cache->misses++;
+    stats_add(STATS_CACHE_MISSES, 1);
+    size_t slot = take_slot(cache);
+    if (slot == NO_SLOT) {
+        return NO_SLOT;
+    }
+    // reserved in the table so the next miss on this block waits instead of reading it too,
+    // it is kept out of the LRU list until it is loaded so it cannot be evicted meanwhile
+    cache->block[slot] = block_number;
+    cache->loading[slot] = 1;
+    table_insert(cache, block_number, slot);
+    guard.unlock();
+    bool ok = load(context, block_number, cache->data + slot * cache->block_size);
+    guard.lock();
+    cache->loading[slot] = 0;
+    cache->loaded[slot % BLOCK_CACHE_WAIT_STRIPES].notify_all();
+    if (!ok) {
+        table_erase(cache, block_number);
+        cache->free_slots.push_back(slot);
+        return NO_SLOT;
+    }
+    lru_push_front(cache, slot);
+    return slot;
+}
+
+const uint8_t* block_cache_pin(block_cache* cache, uint32_t block_number, block_cache_loader load, void* context) {
+    std::unique_lock<std::mutex> guard(cache->lock);
+    size_t slot = find_slot(cache, guard, block_number, load, context);
+    if (slot == NO_SLOT) {
+        return NULL;
+    }
+    cache->pins[slot]++;
+    return cache->data + slot * cache->block_size;
+}
+
+bool block_cache_owns(block_cache* cache, const void* data) {
+    const uint8_t* pointer = (const uint8_t*)data;
+    return pointer >= cache->data and pointer < cache->data + cache->capacity * cache->block_size;
+}
+
+void block_cache_unpin(block_cache* cache, const uint8_t* data) {
+    if (!block_cache_owns(cache, data)) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(cache->lock);
+    size_t slot = (data - cache->data) / cache->block_size;
+    if (cache->pins[slot] > 0) {
+        cache->pins[slot]--;
+    }
+}
+
+bool block_cache_read(block_cache* cache, uint32_t block_number, uint32_t offset, void* buffer, size_t length, block_cache_loader load, void* context) {
+    std::unique_lock<std::mutex> guard(cache->lock);
+    size_t slot = find_slot(cache, guard, block_number, load, context);
+    if (slot == NO_SLOT) {
+        return false;
+    }
+    memcpy(buffer, cache->data + slot * cache->block_size + offset, length);
+    return true;
+}
+
+void block_cache_write(block_cache* cache, uint64_t offset, const void* buffer, size_t length) {
+    std::unique_lock<std::mutex> guard(cache->lock);
+    uint64_t first = offset / cache->block_size;
+    uint64_t last = (offset + length - 1) / cache->block_size;
+    for (uint64_t block_number = first; block_number <= last; block_number++) {
+        size_t found;
+        // a load in flight may have read the block before the write reached the file, it is patched once it is done
+        while ((found = block_number > UINT32_MAX ? NO_SLOT : table_find(cache, block_number)) != NO_SLOT and cache->loading[found]) {
+            wait_loaded(cache, guard, found);
+        }
+        if (found == NO_SLOT) {
+            continue;
+        }
+        // overlap of the write with this block
+        uint64_t block_start = block_number * cache->block_size;
+        uint64_t start = offset > block_start ? offset : block_start;
+        uint64_t end = offset + length < block_start + cache->block_size ? offset + length : block_start + cache->block_size;
+        memcpy(cache->data + found * cache->block_size + (start - block_start), (const uint8_t*)buffer + (start - offset), end - start);
+    }
+}
+
+void block_cache_print_stats(block_cache* cache, FILE* stream) {
+    std::lock_guard<std::mutex> guard(cache->lock);
+    uint64_t lookups = cache->hits + cache->misses;
+    fprintf(stream, "block cache: %zu blocks, %lu hits, %lu misses, %lu evictions, hit rate %.1f%%\n",
+        cache->capacity, (unsigned long)cache->hits, (unsigned long)cache->misses, (unsigned long)cache->evictions,
+        lookups == 0 ? 0.0 : 100.0 * cache->hits / lookups);
+}
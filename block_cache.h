@@ -0,0 +1,68 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+// waiters for a block that is being loaded sleep on one of these, picked by slot
+#define BLOCK_CACHE_WAIT_STRIPES 64
+
+// bounded LRU cache of whole blocks keyed by block number
+// pinned blocks are never evicted, all calls are safe from several threads
+// a miss reserves its slot and loads without holding the lock, so other blocks can be read meanwhile,
+// threads asking for the same block wait for that one load
+struct block_cache {
+    uint32_t block_size;
+    size_t capacity; // number of slots
+    uint8_t* data; // capacity * block_size bytes
+    std::vector<uint32_t> block; // block held by each slot
+    std::vector<uint32_t> pins; // pin count of each slot
+    std::vector<uint8_t> loading; // 1 while the slot's block is read, it is in the table but not in the LRU list
+    std::vector<size_t> prev; // LRU list, head is the most recently used
+    std::vector<size_t> next;
+    size_t head;
+    size_t tail;
+    size_t used; // slots handed out so far, the never used ones are [used, capacity)
+    std::vector<size_t> free_slots; // slots given back after a failed load
+    // block number -> slot, open addressing with linear probing in two flat arrays
+    // so a miss does not allocate a node the way a std::unordered_map insert does
+    std::vector<uint32_t> table_block;
+    std::vector<size_t> table_slot; // NO_SLOT for an empty entry
+    size_t table_mask; // entries - 1, at least twice the slots so probes stay short
+    std::mutex lock;
+    std::condition_variable loaded[BLOCK_CACHE_WAIT_STRIPES]; // notified when a load of a slot in the stripe ends
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+// budget is in bytes, at least BLOCK_CACHE_MIN_BLOCKS blocks are kept
+#define BLOCK_CACHE_MIN_BLOCKS 64
+
+block_cache* block_cache_create(uint32_t block_size, size_t budget);
+
+void block_cache_destroy(block_cache* cache);
+
+// returns the cached block pinned, loading it with load(context, block, buffer) on a miss
+// returns NULL if every slot is pinned or the load failed, the caller then reads on its own
+typedef bool (*block_cache_loader)(void* context, uint32_t block_number, uint8_t* buffer);
+const uint8_t* block_cache_pin(block_cache* cache, uint32_t block_number, block_cache_loader load, void* context);
+
+void block_cache_unpin(block_cache* cache, const uint8_t* data);
+
+// true if data points into the cache
+bool block_cache_owns(block_cache* cache, const void* data);
+
+// copies length bytes at offset inside the block, false if the block could not be cached
+bool block_cache_read(block_cache* cache, uint32_t block_number, uint32_t offset, void* buffer, size_t length, block_cache_loader load, void* context);
+
+// keeps cached copies in sync with a write of length bytes at the byte offset
+void block_cache_write(block_cache* cache, uint64_t offset, const void* buffer, size_t length);
+
+void block_cache_print_stats(block_cache* cache, FILE* stream);
+
+#endif // BLOCK_CACHE_H
@@ -0,0 +1,138 @@
+#include <string.h>
+
+#include "block_class.h"
+#include "pointer_repair.h"
+#include "thread_pool.h"
+#include "stats.h"
+#include "zero_scan.h"
+#include "ext2fs_print.h"
+#include "dir_block.h"
+
+// inode of "." if the entry chain starts with it, 0 otherwise
+static uint32_t dot_inode(const uint8_t* block, uint32_t block_size) {
+    dir_block_reader reader;
+    dir_entry_view entry;
+    dir_block_open(&reader, block, block_size);
+    if (dir_block_next(&reader, &entry) and entry.name == ".") {
+        return entry.inode;
+    }
+    return 0;
+}
+
+// true if the entries chain through the block and end exactly at its end
+static bool is_directory_block(const uint8_t* block, uint32_t block_size, uint32_t inode_count) {
+    dir_block_reader reader;
+    dir_entry_view entry;
+    dir_block_open(&reader, block, block_size);
+    while (dir_block_next(&reader, &entry)) {
+        // stricter than the parser, the smallest record that can hold a name
+        if (entry.length < EXT2_DIR_LENGTH(1)) {
+            return false;
+        }
+        if (entry.inode > inode_count or entry.file_type > 7) {
+            return false;
+        }
+        if (entry.inode != 0 and entry.name.empty()) {
+            return false;
+        }
+    }
+    return dir_block_complete(&reader);
+}
+
+static block_class classify(const uint8_t* block, uint32_t block_size, ext2_super_block* super_block, const signature_index* index, uint32_t* detail) {
+    *detail = 0;
+    if (is_zero(block, block_size)) {
+        return BLOCK_ZERO;
+    }
+
+    int owner = signature_match(index, block);
+    if (owner >= 0) {
+        *detail = owner;
+        return BLOCK_USER_DATA;
+    }
+
+    if (is_directory_block(block, block_size, super_block->inode_count)) {
+        *detail = dot_inode(block, block_size);
+        return BLOCK_DIRECTORY;
+    }
+
+    if (is_pointer_block((const uint32_t*)block, block_size / sizeof(uint32_t), super_block->first_data_block, super_block->block_count, detail)) {
+        return BLOCK_POINTER;
+    }
+    return BLOCK_UNKNOWN;
+}
+
+block_class classify_block(const uint8_t* block, uint32_t block_size, ext2_super_block* super_block, const signature_index* index, uint32_t* detail) {
+    block_class kind = classify(block, block_size, super_block, index, detail);
+    stats_add((stats_counter)(STATS_CLASSIFIED + kind), 1);
+    return kind;
+}
+
+void classify_all_blocks(ext2_image* image, ext2_super_block* super_block, const signature_index* index, unsigned int thread_count, std::vector<block_class_entry>* map) {
+    uint32_t block_size = image->block_size;
+    uint32_t block_count = super_block->block_count;
+    map->assign(block_count, BLOCK_UNKNOWN);
+
+    uint32_t chunk_blocks = image_scan_chunk_size(image) / block_size;
+    if (chunk_blocks == 0) {
+        chunk_blocks = 1;
+    }
+    std::vector<scan_request> requests;
+    for (uint32_t first = 0; first < block_count; first += chunk_blocks) {
+        uint32_t count = block_count - first < chunk_blocks ? block_count - first : chunk_blocks;
+        requests.push_back({ (uint64_t)first * block_size, (size_t)count * block_size });
+    }
+    image_scan(image, requests, thread_count, [&](size_t chunk_num, const uint8_t* chunk) {
+        uint32_t first = chunk_num * chunk_blocks;
+        uint32_t count = requests[chunk_num].length / block_size;
+        if (chunk == NULL) { // a hole of the image file
+            for (uint32_t i = 0; i < count; i++) {
+                (*map)[first + i] = BLOCK_ZERO;
+            }
+            stats_add((stats_counter)(STATS_CLASSIFIED + BLOCK_ZERO), count);
+            return;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t detail;
+            block_class kind = classify_block(chunk + (size_t)i * block_size, block_size, super_block, index, &detail);
+            block_class_entry entry = kind;
+            if (kind == BLOCK_USER_DATA) {
+                entry |= detail << BLOCK_CLASS_BITS;
+            }
+            (*map)[first + i] = entry;
+        }
+    });
+}
+
+bool write_class_map(const char* path, const std::vector<block_class_entry>& map) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        printf("Error: failed to open class map %s\n", path);
+        return false;
+    }
+    bool ok = true;
+    for (block_class_entry entry : map) {
+        uint8_t bytes[2] = { (uint8_t)(entry & 0xff), (uint8_t)(entry >> 8) };
+        ok = ok and fwrite(bytes, 1, 2, file) == 2;
+    }
+    ok = fclose(file) == 0 and ok;
+    return ok;
+}
+
+void print_class_summary(FILE* stream, const std::vector<block_class_entry>& map, const signature_index* index) {
+    static const char* names[BLOCK_CLASS_COUNT] = { "unknown", "zero", "user data", "directory", "pointer" };
+    std::vector<uint64_t> per_class(BLOCK_CLASS_COUNT);
+    std::vector<uint64_t> per_signature(index->signatures.size());
+    for (block_class_entry entry : map) {
+        per_class[BLOCK_CLASS_OF(entry)]++;
+        if (BLOCK_CLASS_OF(entry) == BLOCK_USER_DATA) {
+            per_signature[BLOCK_CLASS_SIGNATURE(entry)]++;
+        }
+    }
+    for (int i = 0; i < BLOCK_CLASS_COUNT; i++) {
+        fprintf(stream, "%s blocks: %lu\n", names[i], (unsigned long)per_class[i]);
+    }
+    for (size_t i = 0; i < per_signature.size(); i++) {
+        fprintf(stream, "identifier %zu blocks: %lu\n", i, (unsigned long)per_signature[i]);
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef BLOCK_CLASS_H
+#define BLOCK_CLASS_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+
+#include "ext2fs.h"
+#include "image.h"
+#include "identifier.h"
+
+enum block_class {
+    BLOCK_UNKNOWN = 0,
+    BLOCK_ZERO = 1,
+    BLOCK_USER_DATA = 2, // starts with one of the identifiers
+    BLOCK_DIRECTORY = 3, // a valid chain of directory entries filling the block
+    BLOCK_POINTER = 4, // zero terminated prefix of block numbers inside the filesystem
+};
+#define BLOCK_CLASS_COUNT 5
+
+// one entry per block: class in the low 3 bits, for user data the identifier index in the upper 13
+typedef uint16_t block_class_entry;
+#define BLOCK_CLASS_BITS 3
+#define BLOCK_CLASS_OF(entry) ((block_class)((entry) & ((1 << BLOCK_CLASS_BITS) - 1)))
+#define BLOCK_CLASS_SIGNATURE(entry) ((entry) >> BLOCK_CLASS_BITS)
+static_assert(SIGNATURE_MAX < (1 << (16 - BLOCK_CLASS_BITS)), "identifier indexes have to fit next to the class");
+
+// detail is the identifier index for user data, the number of pointers for pointer blocks
+// and the inode of the "." entry for directory blocks (0 if the block does not start with ".")
+block_class classify_block(const uint8_t* block, uint32_t block_size, ext2_super_block* super_block, const signature_index* index, uint32_t* detail);
+
+// classifies every block of the image in one parallel streaming pass
+// map is indexed by block number
+void classify_all_blocks(ext2_image* image, ext2_super_block* super_block, const signature_index* index, unsigned int thread_count, std::vector<block_class_entry>* map);
+
+// the map as raw little endian uint16 entries, one per block
+bool write_class_map(const char* path, const std::vector<block_class_entry>& map);
+
+// block counts per class and per identifier
+void print_class_summary(FILE* stream, const std::vector<block_class_entry>& map, const signature_index* index);
+
+#endif // BLOCK_CLASS_H
@@ -0,0 +1,144 @@
+#include "block_map.h"
+#include "arena.h"
+
+#define EXT2_DIR_ACL_INDEX 2 // size_high (dir_acl) is the third word after the block pointers
+
+// pointer block buffers come from the calling thread's pool,
+// so walking an inode does not touch the heap once the first few are allocated
+static uint32_t* get_buffer(uint32_t block_size) {
+    return (uint32_t*)thread_buffer_get(block_size);
+}
+
+uint64_t inode_file_size(const ext2_inode* inode) {
+    uint64_t size = inode->size;
+    if ((inode->mode & 0xf000) == EXT2_I_FTYPE) {
+        size |= (uint64_t)inode->padding[EXT2_DIR_ACL_INDEX] << 32;
+    }
+    return size;
+}
+
+void block_map_open(block_map_iterator* iterator, ext2_image* image, const ext2_inode* inode) {
+    // direct_blocks is followed by the three indirect pointers in the inode
+    block_map_open_pointers(iterator, image, inode->direct_blocks, inode_file_size(inode), inode->block_count_512);
+}
+
+void block_map_open_pointers(block_map_iterator* iterator, ext2_image* image, const uint32_t* pointers, uint64_t size, uint32_t block_count_512) {
+    iterator->image = image;
+    for (int i = 0; i < EXT2_NUM_DIRECT_BLOCKS + BLOCK_MAP_LEVELS; i++) {
+        iterator->root[i] = pointers[i];
+    }
+
+    iterator->per_block = image->block_size / sizeof(uint32_t);
+    iterator->logical = 0;
+    iterator->logical_limit = (size + image->block_size - 1) / image->block_size;
+    iterator->block_limit = block_count_512 / (image->block_size / 512);
+    iterator->returned = 0;
+    for (int i = 0; i <= BLOCK_MAP_LEVELS; i++) {
+        iterator->loaded[i] = 0;
+        iterator->pointers[i] = NULL;
+        iterator->scratch[i] = NULL;
+    }
+}
+
+// pointer block at level (1 to 3), loaded into that level's buffer if it is not held already
+// returns true if it was newly loaded
+static bool load_pointer_block(block_map_iterator* iterator, int level, uint32_t block) {
+    if (iterator->loaded[level] == block) {
+        return false;
+    }
+    if (iterator->scratch[level] == NULL) {
+        iterator->scratch[level] = get_buffer(iterator->image->block_size);
+    }
+    // pinned so reads of data blocks in between cannot evict it from the block cache
+    image_block_unpin(iterator->image, (const uint8_t*)iterator->pointers[level]);
+    iterator->pointers[level] = (const uint32_t*)image_block_pin(iterator->image, block, iterator->scratch[level]);
+    iterator->loaded[level] = block;
+    return true;
+}
+
+bool block_map_next(block_map_iterator* iterator, block_map_entry* entry) {
+    uint64_t per_block = iterator->per_block;
+    while (iterator->logical < iterator->logical_limit and iterator->returned < iterator->block_limit) {
+        uint64_t n = iterator->logical;
+
+        if (n < EXT2_NUM_DIRECT_BLOCKS) {
+            iterator->logical++;
+            if (iterator->root[n] == 0) {
+                continue;
+            }
+            entry->logical = n;
+            entry->physical = iterator->root[n];
+            entry->level = 0;
+            iterator->returned++;
+            return true;
+        }
+
+        // find which tree n falls in and its offset inside that tree
+        n -= EXT2_NUM_DIRECT_BLOCKS;
+        int depth = 1;
+        uint64_t span = per_block; // file blocks covered by the tree
+        while (depth <= BLOCK_MAP_LEVELS and n >= span) {
+            n -= span;
+            depth++;
+            span *= per_block;
+        }
+        if (depth > BLOCK_MAP_LEVELS) {
+            break; // past what triple indirection can address
+        }
+
+        // descend from the tree's root to the data block, level counts down to 1
+        uint32_t block = iterator->root[EXT2_NUM_DIRECT_BLOCKS + depth - 1];
+        const uint32_t* parent = NULL;
+        uint64_t parent_index = 0;
+        bool skipped = false;
+        for (int level = depth; level >= 1; level--) {
+            span /= per_block; // file blocks below one entry of this pointer block
+            if (block == 0) {
+                // hole, skip everything this missing block would have covered
+                uint64_t covered = span * per_block;
+                iterator->logical += covered - n % covered;
+                skipped = true;
+                break;
+            }
+            if (load_pointer_block(iterator, level, block)) {
+                // the next sibling is most likely needed next
+                if (parent != NULL and parent_index + 1 < per_block and parent[parent_index + 1] != 0) {
+                    image_prefetch(iterator->image, parent[parent_index + 1]);
+                }
+                entry->logical = iterator->logical;
+                entry->physical = block;
+                entry->level = level;
+                iterator->returned++;
+                return true;
+            }
+            parent = iterator->pointers[level];
+            parent_index = (n / span) % per_block;
+            block = parent[parent_index];
+        }
+        if (skipped) {
+            continue;
+        }
+
+        iterator->logical++;
+        if (block == 0) {
+            continue;
+        }
+        entry->logical = iterator->logical - 1;
+        entry->physical = block;
+        entry->level = 0;
+        iterator->returned++;
+        return true;
+    }
+    return false;
+}
+
+void block_map_close(block_map_iterator* iterator) {
+    for (int i = 0; i <= BLOCK_MAP_LEVELS; i++) {
+        image_block_unpin(iterator->image, (const uint8_t*)iterator->pointers[i]);
+        if (iterator->scratch[i] != NULL) {
+            thread_buffer_put((uint8_t*)iterator->scratch[i], iterator->image->block_size);
+            iterator->scratch[i] = NULL;
+        }
+        iterator->pointers[i] = NULL;
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef BLOCK_MAP_H
+#define BLOCK_MAP_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "ext2fs.h"
+#include "image.h"
+
+#define BLOCK_MAP_LEVELS 3 // single, double and triple indirection
+
+// one block of an inode's mapping
+struct block_map_entry {
+    uint64_t logical; // file block number, for pointer blocks the first file block below them
+    uint32_t physical; // block number on disk
+    int level; // 0 for data blocks, 1 to 3 for pointer blocks (1 holds data block numbers)
+};
+
+// walks the logical to physical block mapping of an inode
+// holes (zero pointers) are skipped without ending the walk, it stops once ceil(size / block_size)
+// file blocks are covered or block_count_512 blocks (data and pointer) were returned.
+// pointer blocks are returned right before the first data block below them and read through
+// one fixed buffer (or pinned cache block) per level, the next sibling pointer block is prefetched when one is loaded
+struct block_map_iterator {
+    ext2_image* image;
+    uint32_t root[EXT2_NUM_DIRECT_BLOCKS + BLOCK_MAP_LEVELS]; // copy of the inode's pointers
+    uint32_t per_block; // pointers in one block
+    uint64_t logical; // next file block to look at
+    uint64_t logical_limit; // file blocks covered by size
+    uint64_t block_limit; // blocks the inode owns according to block_count_512
+    uint64_t returned; // blocks returned so far
+    uint32_t loaded[BLOCK_MAP_LEVELS + 1]; // physical number of the pointer block held per level, 0 for none
+    const uint32_t* pointers[BLOCK_MAP_LEVELS + 1]; // view of that pointer block
+    uint32_t* scratch[BLOCK_MAP_LEVELS + 1]; // per level buffers from the thread's pool, for images that are not mapped
+};
+
+void block_map_open(block_map_iterator* iterator, ext2_image* image, const ext2_inode* inode);
+
+// same from the 15 pointers (direct, then single, double and triple indirect), size and block_count_512
+void block_map_open_pointers(block_map_iterator* iterator, ext2_image* image, const uint32_t* pointers, uint64_t size, uint32_t block_count_512);
+
+// false once the mapping is exhausted
+bool block_map_next(block_map_iterator* iterator, block_map_entry* entry);
+
+void block_map_close(block_map_iterator* iterator);
+
+// file size including the high 32 bits regular files keep in dir_acl
+uint64_t inode_file_size(const ext2_inode* inode);
+
+#endif // BLOCK_MAP_H
@@ -0,0 +1,38 @@
+#include "dir_block.h"
+#include "ext2fs_print.h"
+
+#include <string.h>
+
+void dir_block_open(dir_block_reader* reader, const uint8_t* block, uint32_t block_size) {
+    reader->block = block;
+    reader->block_size = block_size;
+    reader->offset = 0;
+    reader->corrupt = false;
+}
+
+bool dir_block_next(dir_block_reader* reader, dir_entry_view* entry) {
+    if (reader->corrupt or reader->offset >= reader->block_size) {
+        return false;
+    }
+    uint32_t offset = reader->offset;
+    if (offset + sizeof(ext2_dir_entry) > reader->block_size) {
+        reader->corrupt = true;
+        return false;
+    }
+
+    // the header may not be aligned when a caller hands in an odd buffer, so it is copied out
+    ext2_dir_entry header;
+    memcpy(&header, reader->block + offset, sizeof(ext2_dir_entry));
+    if (header.length % 4 != 0 or header.length < EXT2_DIR_LENGTH(header.name_length) or offset + header.length > reader->block_size) {
+        reader->corrupt = true;
+        return false;
+    }
+
+    entry->inode = header.inode;
+    entry->file_type = header.file_type;
+    entry->name = std::string_view((const char*)reader->block + offset + sizeof(ext2_dir_entry), header.name_length);
+    entry->offset = offset;
+    entry->length = header.length;
+    reader->offset = offset + header.length;
+    return true;
+}
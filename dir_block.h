@@ -0,0 +1,40 @@
+#ifndef DIR_BLOCK_H
+#define DIR_BLOCK_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string_view>
+
+#include "ext2fs.h"
+
+// walks the ext2_dir_entry records of one directory block in place, the block is read once by the caller
+// a record is only returned if its length is a multiple of 4, holds the header and the name
+// (EXT2_DIR_LENGTH(name_length) <= length) and stays inside the block, the walk stops at the first
+// record that does not, so a corrupt length can neither loop nor run past the block
+
+struct dir_entry_view {
+    uint32_t inode; // 0 for an unused record
+    uint8_t file_type;
+    std::string_view name; // points into the block
+    uint32_t offset; // of the record inside the block
+    uint16_t length;
+};
+
+struct dir_block_reader {
+    const uint8_t* block;
+    uint32_t block_size;
+    uint32_t offset; // next record
+    bool corrupt; // the walk stopped at an invalid record
+};
+
+void dir_block_open(dir_block_reader* reader, const uint8_t* block, uint32_t block_size);
+
+// next record, unused ones (inode 0) included, false at the end of the block or at a corrupt record
+bool dir_block_next(dir_block_reader* reader, dir_entry_view* entry);
+
+// true if the records chained exactly to the end of the block
+static inline bool dir_block_complete(const dir_block_reader* reader) {
+    return !reader->corrupt and reader->offset == reader->block_size;
+}
+
+#endif // DIR_BLOCK_H
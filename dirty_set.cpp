@@ -0,0 +1,205 @@
+#include "dirty_set.h"
+#include "stats.h"
+
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <vector>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+dirty_set* dirty_set_create(uint32_t block_size) {
+    dirty_set* set = new dirty_set;
+    set->block_size = block_size;
+    buffer_pool_init(&set->buffers, block_size);
+    set->count = 0;
+    return set;
+}
+
+void dirty_set_clear(dirty_set* set) {
+    for (auto& entry : set->blocks) {
+        buffer_pool_put(&set->buffers, entry.second);
+    }
+    set->blocks.clear();
+    set->count = 0;
+}
+
+void dirty_set_destroy(dirty_set* set) {
+    if (set == NULL) {
+        return;
+    }
+    dirty_set_clear(set);
+    buffer_pool_free(&set->buffers);
+    delete set;
+}
+
+bool dirty_set_write(dirty_set* set, uint64_t offset, const void* buffer, size_t length, dirty_set_loader load, void* context) {
+    const uint8_t* source = (const uint8_t*)buffer;
+    std::lock_guard<std::mutex> guard(set->lock);
+    while (length > 0) {
+        uint64_t block_number = offset / set->block_size;
+        uint32_t block_offset = offset % set->block_size;
+        size_t part = set->block_size - block_offset < length ? set->block_size - block_offset : length;
+
+        uint8_t*& block = set->blocks[block_number];
+        if (block == NULL) {
+            block = buffer_pool_get(&set->buffers);
+            // a whole block write does not need the old contents
+            if (part < set->block_size and !load(context, block_number, block)) {
+                buffer_pool_put(&set->buffers, block);
+                set->blocks.erase(block_number);
+                return false;
+            }
+            set->count++;
+        }
+        memcpy(block + block_offset, source, part);
+
+        offset += part;
+        source += part;
+        length -= part;
+    }
+    return true;
+}
+
+const uint8_t* dirty_set_find(dirty_set* set, uint64_t block_number) {
+    if (set->count == 0) {
+        return NULL;
+    }
+    std::lock_guard<std::mutex> guard(set->lock);
+    auto it = set->blocks.find(block_number);
+    return it == set->blocks.end() ? NULL : it->second;
+}
+
+bool dirty_set_overlaps(dirty_set* set, uint64_t offset, size_t length) {
+    if (set->count == 0 or length == 0) {
+        return false;
+    }
+    std::lock_guard<std::mutex> guard(set->lock);
+    auto it = set->blocks.lower_bound(offset / set->block_size);
+    return it != set->blocks.end() and it->first <= (offset + length - 1) / set->block_size;
+}
+
+void dirty_set_overlay(dirty_set* set, uint64_t offset, void* buffer, size_t length) {
+    if (set->count == 0 or length == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(set->lock);
+    uint64_t end = offset + length;
+    for (auto it = set->blocks.lower_bound(offset / set->block_size); it != set->blocks.end(); it++) {
+        uint64_t block_start = it->first * set->block_size;
+        if (block_start >= end) {
+            break;
+        }
+        uint64_t start = block_start > offset ? block_start : offset;
+        uint64_t stop = block_start + set->block_size < end ? block_start + set->block_size : end;
+        memcpy((uint8_t*)buffer + (start - offset), it->second + (start - block_start), stop - start);
+    }
+}
+
+// pwritev until everything is written, false on error
+static bool write_run(int fd, struct iovec* iov, int count, uint64_t offset) {
+    while (count > 0) {
+        ssize_t written = pwritev(fd, iov, count, offset);
+        stats_add(STATS_WRITE_CALLS, 1);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        stats_add(STATS_BYTES_WRITTEN, written);
+        offset += written;
+        // skip what was written, a short write can stop inside a buffer
+        while (count > 0 and (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (uint8_t*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+// number of bytes in which the staged block differs from the disk, a block past the end counts fully
+static uint32_t changed_bytes(dirty_set* set, int fd, uint64_t block_number, const uint8_t* block, uint8_t* disk) {
+    ssize_t got = pread(fd, disk, set->block_size, block_number * set->block_size);
+    if (got < 0) {
+        got = 0;
+    }
+    stats_add(STATS_READ_CALLS, 1);
+    stats_add(STATS_BYTES_READ, got);
+    uint32_t changed = set->block_size - got;
+    for (ssize_t i = 0; i < got; i++) {
+        changed += disk[i] != block[i];
+    }
+    return changed;
+}
+
+uint64_t dirty_set_pending(dirty_set* set, int fd, std::vector<std::pair<uint64_t, uint8_t*>>* pending, FILE* report) {
+    std::vector<uint8_t> disk(set->block_size);
+    uint64_t changed_total = 0;
+    for (auto& entry : set->blocks) {
+        uint32_t changed = changed_bytes(set, fd, entry.first, entry.second, disk.data());
+        if (changed == 0) {
+            continue;
+        }
+        pending->push_back(entry);
+        changed_total += changed;
+        if (report != NULL) {
+            fprintf(report, "pending block %lu: %u bytes changed\n", (unsigned long)entry.first, changed);
+        }
+    }
+    return changed_total;
+}
+
+bool dirty_set_flush(dirty_set* set, int fd, bool dry_run, FILE* report) {
+    std::lock_guard<std::mutex> guard(set->lock);
+
+    // drop blocks that ended up equal to the disk, the rest is already in block order
+    std::vector<std::pair<uint64_t, uint8_t*>> pending;
+    uint64_t changed_total = dirty_set_pending(set, fd, &pending, dry_run ? report : NULL);
+
+    std::vector<struct iovec> iov;
+    size_t runs = 0;
+    bool ok = true;
+    for (size_t i = 0; i < pending.size(); ) {
+        // one run is the longest stretch of adjacent blocks that fits in one pwritev
+        size_t j = i;
+        iov.clear();
+        while (j < pending.size() and pending[j].first == pending[i].first + (j - i) and iov.size() < IOV_MAX) {
+            iov.push_back({ pending[j].second, set->block_size });
+            j++;
+        }
+        if (!dry_run and !write_run(fd, iov.data(), iov.size(), pending[i].first * set->block_size)) {
+            printf("Error: failed to write block %lu\n", (unsigned long)pending[i].first);
+            ok = false;
+            break;
+        }
+        runs++;
+        i = j;
+    }
+
+    if (report != NULL) {
+        fprintf(report, "%s %lu blocks (%lu bytes changed) in %lu writes\n", dry_run ? "dry run, would write" : "wrote",
+            (unsigned long)pending.size(), (unsigned long)changed_total, (unsigned long)runs);
+    }
+    if (dry_run) {
+        return true;
+    }
+    if (ok and !pending.empty()) {
+        stats_add(STATS_SYNC_CALLS, 1);
+        if (fsync(fd) != 0) {
+            printf("Error: failed to sync the image\n");
+            ok = false;
+        }
+    }
+    dirty_set_clear(set);
+    return ok;
+}
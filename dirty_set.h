@@ -0,0 +1,57 @@
+#ifndef DIRTY_SET_H
+#define DIRTY_SET_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "arena.h"
+
+// modified blocks of the image, kept in memory until the repair is committed
+// writes land here instead of the image so readers see them but nothing reaches the disk
+// until dirty_set_flush, which writes every block at once in block order
+// all calls are safe from several threads
+struct dirty_set {
+    uint32_t block_size;
+    std::map<uint64_t, uint8_t*> blocks; // block number -> staged contents, ordered for the flush
+    buffer_pool buffers; // staged contents, reused after a clear
+    std::mutex lock;
+    std::atomic<size_t> count; // lets readers skip the lock while nothing is staged
+};
+
+dirty_set* dirty_set_create(uint32_t block_size);
+
+void dirty_set_destroy(dirty_set* set);
+
+// stages length bytes at the byte offset, a block staged for the first time is loaded
+// with load(context, block, buffer) before it is patched
+typedef bool (*dirty_set_loader)(void* context, uint64_t block_number, uint8_t* buffer);
+bool dirty_set_write(dirty_set* set, uint64_t offset, const void* buffer, size_t length, dirty_set_loader load, void* context);
+
+// staged copy of the block, NULL if it is not dirty
+// stays valid until the set is flushed or destroyed
+const uint8_t* dirty_set_find(dirty_set* set, uint64_t block_number);
+
+// true if any staged block overlaps [offset, offset + length)
+bool dirty_set_overlaps(dirty_set* set, uint64_t offset, size_t length);
+
+// copies the staged bytes of [offset, offset + length) over buffer, which holds the bytes at offset
+void dirty_set_overlay(dirty_set* set, uint64_t offset, void* buffer, size_t length);
+
+// collects the staged blocks that differ from fd in block order, returns the number of changed bytes
+// report (if not NULL) gets one line per block, called with the lock held
+uint64_t dirty_set_pending(dirty_set* set, int fd, std::vector<std::pair<uint64_t, uint8_t*>>* pending, FILE* report);
+
+// drops every staged block, called with the lock held
+void dirty_set_clear(dirty_set* set);
+
+// writes the staged blocks that differ from the disk to fd, one pwritev per run of adjacent blocks,
+// then fsyncs once and empties the set
+// with dry_run nothing is written and the set is kept, report (if not NULL) lists the pending blocks
+bool dirty_set_flush(dirty_set* set, int fd, bool dry_run, FILE* report);
+
+#endif // DIRTY_SET_H
@@ -15,6 +15,9 @@
 
 #define EXT2_SUPER_MAGIC 0xEF53
 
+/* feature_ro_compat: super block and BGDT copies only in groups 0, 1 and powers of 3, 5, 7 */
+#define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+
 /* Can use this to convert super block log_* fields to actual sizes */
 #define EXT2_UNLOG(v) (1UL << (10UL + (v)))
 
@@ -73,6 +76,13 @@ struct ext2_super_block {
     uint32_t feature_compat;
     uint32_t feature_incompat;
     uint32_t feature_ro_compat;
+    uint8_t uuid[16]; /* Volume id */
+    char volume_name[16];
+    char last_mounted[64];
+    uint32_t algorithm_bitmap; /* Compression, unused */
+    uint8_t prealloc_blocks;
+    uint8_t prealloc_dir_blocks;
+    uint16_t reserved_gdt_blocks; /* Blocks reserved after the BGDT for online growth */
     /* More stuff after this, but don't worry about them! */
 };
 
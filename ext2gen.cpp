@@ -0,0 +1,986 @@
+// ext2gen: writes synthetic ext2 images for scale testing and breaks them the way the test variants are broken
+//
+//   ext2gen create [options] <image>
+//   ext2gen corrupt [--inode-bitmaps] [--block-bitmaps] [--pointers N] [--seed N] <image>
+//
+// everything is derived from the seed, the same options always give the same image
+// the image is a sparse file, only metadata and file blocks are written
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+#include <string>
+
+#include "ext2fs.h"
+
+#define EXT2_FEATURE_RO_COMPAT_LARGE_FILE 0x0002
+#define EXT2_FEATURE_INCOMPAT_FILETYPE 0x0002
+#define EXT2_FIRST_INODE 11
+#define EXT2_LOST_FOUND_INODE 11
+#define IDENTIFIER_SIZE 32
+#define GENERATOR_TIME 1700000000U // every time stamp, so images do not depend on the clock
+#define WRITE_RUN_SIZE (1U << 20) // data blocks are written in runs of up to this many bytes
+
+enum size_distribution {
+    SIZE_UNIFORM, // every size in [min, max] equally likely
+    SIZE_LOG, // log-uniform, many small files and a few large ones like real trees
+};
+
+struct generator_options {
+    uint64_t size; // bytes
+    uint32_t block_size;
+    uint32_t group_count; // 0 picks blocks_per_group = 8 * block_size
+    uint32_t inodes_per_group; // 0 picks one inode per 16 KiB
+    uint32_t fanout; // subdirectories per directory
+    uint32_t depth; // levels of subdirectories below the root
+    uint32_t files_per_directory;
+    uint64_t file_size_min;
+    uint64_t file_size_max;
+    size_distribution distribution;
+    uint32_t fragmentation; // percent of data blocks placed at a random spot instead of after the previous one
+    uint8_t identifier[IDENTIFIER_SIZE]; // first bytes of every file block
+    uint64_t seed;
+};
+
+// xorshift64*, small and the same everywhere
+struct random_state {
+    uint64_t state;
+};
+
+static uint64_t next_random(random_state* random) {
+    random->state ^= random->state >> 12;
+    random->state ^= random->state << 25;
+    random->state ^= random->state >> 27;
+    return random->state * 0x2545F4914F6CDD1DULL;
+}
+
+static uint64_t random_below(random_state* random, uint64_t limit) {
+    return limit == 0 ? 0 : next_random(random) % limit;
+}
+
+static void seed_random(random_state* random, uint64_t seed) {
+    random->state = seed * 0x9E3779B97F4A7C15ULL + 1; // never 0
+}
+
+struct generator {
+    int fd;
+    generator_options* options;
+    random_state random;
+
+    // geometry
+    uint32_t block_size;
+    uint32_t block_count;
+    uint32_t first_data_block;
+    uint32_t blocks_per_group;
+    uint32_t inodes_per_group;
+    uint32_t group_count;
+    uint32_t bgdt_blocks;
+    uint32_t inode_table_blocks;
+
+    std::vector<ext2_block_group_descriptor> bgdt;
+    std::vector<uint8_t> block_bitmap; // bit (block - first_data_block), the whole filesystem
+    std::vector<uint8_t> inode_bitmap; // bit (inode - 1)
+    uint32_t free_blocks;
+    uint32_t free_inodes;
+    uint32_t next_directory_group; // directories are spread over the groups round robin
+    bool large_file; // a file needs size_high
+    bool full; // stop adding files
+
+    // pending run of adjacent data blocks
+    std::vector<uint8_t> run;
+    uint32_t run_first;
+    uint32_t run_count;
+
+    uint64_t files;
+    uint64_t directories;
+    uint64_t data_bytes;
+};
+
+// size with an optional K, M, G or T suffix
+static bool parse_size(const char* text, uint64_t* size) {
+    char* end;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (end == text) {
+        return false;
+    }
+    switch (*end) {
+    case 'K': case 'k': value <<= 10; end++; break;
+    case 'M': case 'm': value <<= 20; end++; break;
+    case 'G': case 'g': value <<= 30; end++; break;
+    case 'T': case 't': value <<= 40; end++; break;
+    default: break;
+    }
+    *size = value;
+    return *end == '\0';
+}
+
+static bool parse_identifier_text(const char* text, uint8_t* identifier) {
+    memset(identifier, 0, IDENTIFIER_SIZE);
+    int count = 0;
+    while (*text != '\0') {
+        if (*text == ' ') {
+            text++;
+            continue;
+        }
+        char* end;
+        unsigned long value = strtoul(text, &end, 16);
+        if (end == text or value > 0xff or count == IDENTIFIER_SIZE) {
+            return false;
+        }
+        identifier[count++] = value;
+        text = end;
+    }
+    return count > 0;
+}
+
+static bool write_at(generator* gen, const void* data, size_t length, uint64_t offset) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    while (length > 0) {
+        ssize_t written = pwrite(gen->fd, bytes, length, offset);
+        if (written < 0 and errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            printf("Error: failed to write the image: %s\n", strerror(errno));
+            exit(1);
+        }
+        bytes += written;
+        offset += written;
+        length -= written;
+    }
+    return true;
+}
+
+static bool group_has_super_block(uint32_t group) {
+    if (group <= 1) {
+        return true;
+    }
+    for (uint32_t base : { 3, 5, 7 }) {
+        uint64_t power = base;
+        while (power < group) {
+            power *= base;
+        }
+        if (power == group) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint32_t group_first_block(generator* gen, uint32_t group) {
+    return gen->first_data_block + group * gen->blocks_per_group;
+}
+
+static uint32_t group_blocks(generator* gen, uint32_t group) {
+    uint32_t first = group_first_block(gen, group);
+    return gen->block_count - first < gen->blocks_per_group ? gen->block_count - first : gen->blocks_per_group;
+}
+
+static uint32_t group_overhead(generator* gen, uint32_t group) {
+    return (group_has_super_block(group) ? 1 + gen->bgdt_blocks : 0) + 2 + gen->inode_table_blocks;
+}
+
+static void use_block(generator* gen, uint32_t block) {
+    uint32_t bit = block - gen->first_data_block;
+    gen->block_bitmap[bit / 8] |= 1 << (bit % 8);
+    gen->free_blocks--;
+}
+
+// lays out the groups and marks their metadata, false if the options do not give a usable filesystem
+static bool plan_layout(generator* gen) {
+    generator_options* options = gen->options;
+    gen->block_size = options->block_size;
+    gen->first_data_block = gen->block_size == 1024 ? 1 : 0;
+    uint64_t block_count = options->size / gen->block_size;
+    if (block_count > UINT32_MAX) {
+        printf("Error: %lu blocks do not fit ext2, use a larger block size\n", (unsigned long)block_count);
+        return false;
+    }
+    gen->block_count = block_count;
+
+    uint32_t max_group_blocks = 8 * gen->block_size;
+    uint32_t data_blocks = gen->block_count - gen->first_data_block;
+    gen->blocks_per_group = max_group_blocks;
+    if (options->group_count != 0) {
+        gen->blocks_per_group = (data_blocks + options->group_count - 1) / options->group_count;
+        gen->blocks_per_group = (gen->blocks_per_group + 7) / 8 * 8;
+        if (gen->blocks_per_group > max_group_blocks) {
+            printf("Error: %u groups are too few for %u blocks, at least %u are needed\n", options->group_count, data_blocks, (data_blocks + max_group_blocks - 1) / max_group_blocks);
+            return false;
+        }
+    }
+    gen->group_count = (data_blocks + gen->blocks_per_group - 1) / gen->blocks_per_group;
+
+    // whole inode table blocks and whole bitmap bytes
+    uint32_t inodes_per_block = gen->block_size / EXT2_INODE_SIZE;
+    uint32_t inodes_per_group = options->inodes_per_group;
+    if (inodes_per_group == 0) {
+        inodes_per_group = (uint64_t)gen->blocks_per_group * gen->block_size / 16384;
+    }
+    uint32_t step = inodes_per_block > 8 ? inodes_per_block : 8;
+    inodes_per_group = (inodes_per_group + step - 1) / step * step;
+    if (inodes_per_group < 16) {
+        inodes_per_group = 16;
+    }
+    if (inodes_per_group > max_group_blocks) {
+        inodes_per_group = max_group_blocks;
+    }
+    gen->inodes_per_group = inodes_per_group;
+    gen->inode_table_blocks = inodes_per_group / inodes_per_block;
+
+    gen->bgdt_blocks = ((uint64_t)gen->group_count * sizeof(ext2_block_group_descriptor) + gen->block_size - 1) / gen->block_size;
+    // a last group too small for its own metadata is left out like mke2fs does
+    if (gen->group_count > 1 and group_blocks(gen, gen->group_count - 1) < group_overhead(gen, gen->group_count - 1) + 16) {
+        gen->block_count -= group_blocks(gen, gen->group_count - 1);
+        gen->group_count--;
+    }
+    if (gen->group_count == 0 or group_blocks(gen, 0) < group_overhead(gen, 0) + 16 or (uint64_t)gen->group_count * inodes_per_group > UINT32_MAX) {
+        printf("Error: the image is too small for an ext2 filesystem\n");
+        return false;
+    }
+
+    gen->block_bitmap.assign(((uint64_t)gen->group_count * gen->blocks_per_group + 7) / 8, 0);
+    gen->inode_bitmap.assign(((uint64_t)gen->group_count * inodes_per_group + 7) / 8, 0);
+    gen->free_blocks = gen->block_count - gen->first_data_block;
+    gen->free_inodes = gen->group_count * inodes_per_group;
+    gen->bgdt.assign(gen->group_count, ext2_block_group_descriptor());
+    memset(gen->bgdt.data(), 0, gen->group_count * sizeof(ext2_block_group_descriptor));
+
+    for (uint32_t group = 0; group < gen->group_count; group++) {
+        uint32_t block = group_first_block(gen, group);
+        if (group_has_super_block(group)) {
+            for (uint32_t i = 0; i < 1 + gen->bgdt_blocks; i++) {
+                use_block(gen, block++);
+            }
+        }
+        gen->bgdt[group].block_bitmap = block;
+        use_block(gen, block++);
+        gen->bgdt[group].inode_bitmap = block;
+        use_block(gen, block++);
+        gen->bgdt[group].inode_table = block;
+        for (uint32_t i = 0; i < gen->inode_table_blocks; i++) {
+            use_block(gen, block++);
+        }
+    }
+    return true;
+}
+
+// a free block, the goal itself if possible, otherwise the next free one after it; 0 if the image is full
+static uint32_t allocate_block(generator* gen, uint32_t goal) {
+    if (gen->free_blocks == 0) {
+        return 0;
+    }
+    if (goal < gen->first_data_block or goal >= gen->block_count) {
+        goal = gen->first_data_block;
+    }
+    uint32_t total = gen->block_count - gen->first_data_block;
+    uint32_t bit = goal - gen->first_data_block;
+    for (uint32_t checked = 0; checked < total; ) {
+        // whole used bytes are skipped at once
+        if (bit % 8 == 0 and bit + 8 <= total and gen->block_bitmap[bit / 8] == 0xff) {
+            bit += 8;
+            checked += 8;
+        }
+        else {
+            if (!((gen->block_bitmap[bit / 8] >> (bit % 8)) & 1)) {
+                use_block(gen, bit + gen->first_data_block);
+                return bit + gen->first_data_block;
+            }
+            bit++;
+            checked++;
+        }
+        if (bit >= total) {
+            bit = 0;
+        }
+    }
+    return 0;
+}
+
+// next block of a file, right after the previous one unless fragmentation moves it
+static uint32_t allocate_next_block(generator* gen, uint32_t* goal) {
+    if (gen->options->fragmentation > 0 and random_below(&gen->random, 100) < gen->options->fragmentation) {
+        *goal = gen->first_data_block + random_below(&gen->random, gen->block_count - gen->first_data_block);
+    }
+    uint32_t block = allocate_block(gen, *goal);
+    *goal = block + 1;
+    return block;
+}
+
+// a free inode, starting the search in group
+static uint32_t allocate_inode(generator* gen, uint32_t group) {
+    for (uint32_t i = 0; i < gen->group_count; i++) {
+        uint32_t g = (group + i) % gen->group_count;
+        for (uint32_t j = 0; j < gen->inodes_per_group; j++) {
+            uint32_t bit = g * gen->inodes_per_group + j;
+            if (!((gen->inode_bitmap[bit / 8] >> (bit % 8)) & 1)) {
+                gen->inode_bitmap[bit / 8] |= 1 << (bit % 8);
+                gen->free_inodes--;
+                return bit + 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static uint32_t inode_group(generator* gen, uint32_t inode) {
+    return (inode - 1) / gen->inodes_per_group;
+}
+
+static void write_inode(generator* gen, uint32_t number, const ext2_inode* inode) {
+    uint32_t group = inode_group(gen, number);
+    uint32_t index = (number - 1) % gen->inodes_per_group;
+    uint64_t offset = (uint64_t)gen->bgdt[group].inode_table * gen->block_size + (uint64_t)index * EXT2_INODE_SIZE;
+    write_at(gen, inode, sizeof(ext2_inode), offset);
+}
+
+static void flush_run(generator* gen) {
+    if (gen->run_count > 0) {
+        write_at(gen, gen->run.data(), (size_t)gen->run_count * gen->block_size, (uint64_t)gen->run_first * gen->block_size);
+        gen->run_count = 0;
+    }
+}
+
+// queues one block for writing, adjacent blocks go out with one write
+static void write_block(generator* gen, uint32_t block, const uint8_t* data) {
+    size_t run_blocks = WRITE_RUN_SIZE / gen->block_size;
+    if (gen->run_count > 0 and (block != gen->run_first + gen->run_count or gen->run_count == run_blocks)) {
+        flush_run(gen);
+    }
+    if (gen->run_count == 0) {
+        gen->run_first = block;
+    }
+    memcpy(gen->run.data() + (size_t)gen->run_count * gen->block_size, data, gen->block_size);
+    gen->run_count++;
+}
+
+// contents of a file block: the identifier, then printable filler up to the end of the file, zeros after it
+static void fill_file_block(generator* gen, uint8_t* block, uint64_t bytes) {
+    memset(block, 0, gen->block_size);
+    size_t used = bytes < gen->block_size ? bytes : gen->block_size;
+    for (size_t i = 0; i < used; i += 8) {
+        uint64_t value = next_random(&gen->random);
+        for (size_t j = 0; j < 8 and i + j < used; j++) {
+            block[i + j] = 'a' + ((value >> (j * 8)) & 0xff) % 26;
+        }
+    }
+    memcpy(block, gen->options->identifier, used < IDENTIFIER_SIZE ? used : IDENTIFIER_SIZE);
+}
+
+// blocks a file of block_count data blocks needs in total, with its pointer blocks
+static uint64_t blocks_with_pointers(generator* gen, uint64_t block_count) {
+    uint64_t per_block = gen->block_size / sizeof(uint32_t);
+    uint64_t total = block_count;
+    if (block_count > EXT2_NUM_DIRECT_BLOCKS) {
+        uint64_t left = block_count - EXT2_NUM_DIRECT_BLOCKS;
+        total += 1; // single
+        if (left > per_block) {
+            left -= per_block;
+            uint64_t doubles = left < per_block * per_block ? left : per_block * per_block;
+            total += 1 + (doubles + per_block - 1) / per_block;
+            left -= doubles;
+            if (left > 0) {
+                total += 1 + (left + per_block * per_block - 1) / (per_block * per_block) + (left + per_block - 1) / per_block;
+            }
+        }
+    }
+    return total;
+}
+
+// allocation state while mapping the blocks of one file, data collects the data blocks in file order
+struct block_writer {
+    generator* gen;
+    uint32_t goal;
+    uint64_t next; // index of the next data block
+    uint64_t count; // data blocks in total
+    std::vector<uint32_t>* data; // the data blocks in file order
+    uint32_t pointer_blocks;
+    bool failed;
+};
+
+static uint32_t allocate_data_block(block_writer* writer) {
+    uint32_t block = allocate_next_block(writer->gen, &writer->goal);
+    if (block == 0) {
+        writer->failed = true;
+        return 0;
+    }
+    writer->data->push_back(block);
+    writer->next++;
+    return block;
+}
+
+static uint32_t allocate_pointer_block(block_writer* writer, int level) {
+    generator* gen = writer->gen;
+    // the pointer block comes before the blocks it points to, as ext2 allocates them
+    uint32_t block = allocate_next_block(gen, &writer->goal);
+    if (block == 0) {
+        writer->failed = true;
+        return 0;
+    }
+    writer->pointer_blocks++;
+    uint32_t per_block = gen->block_size / sizeof(uint32_t);
+    std::vector<uint32_t> pointers(per_block, 0);
+    for (uint32_t i = 0; i < per_block and writer->next < writer->count and !writer->failed; i++) {
+        pointers[i] = level == 1 ? allocate_data_block(writer) : allocate_pointer_block(writer, level - 1);
+    }
+    write_block(gen, block, (const uint8_t*)pointers.data());
+    return block;
+}
+
+// allocates count data blocks for inode and fills in its pointers, false if the image is full
+static bool map_blocks(generator* gen, ext2_inode* inode, uint64_t count, uint32_t goal, std::vector<uint32_t>* data) {
+    block_writer writer = { gen, goal, 0, count, data, 0, false };
+    for (int i = 0; i < EXT2_NUM_DIRECT_BLOCKS and writer.next < count and !writer.failed; i++) {
+        inode->direct_blocks[i] = allocate_data_block(&writer);
+    }
+    uint32_t* indirect[3] = { &inode->single_indirect, &inode->double_indirect, &inode->triple_indirect };
+    for (int level = 1; level <= 3 and writer.next < count and !writer.failed; level++) {
+        *indirect[level - 1] = allocate_pointer_block(&writer, level);
+    }
+    inode->block_count_512 = (uint32_t)((writer.next + writer.pointer_blocks) * (gen->block_size / 512));
+    return !writer.failed and writer.next == count;
+}
+
+static void init_inode(ext2_inode* inode, uint16_t mode, uint16_t links) {
+    memset(inode, 0, sizeof(*inode));
+    inode->mode = mode;
+    inode->uid = EXT2_I_UID;
+    inode->gid = EXT2_I_GID;
+    inode->access_time = GENERATOR_TIME;
+    inode->creation_time = GENERATOR_TIME;
+    inode->modification_time = GENERATOR_TIME;
+    inode->link_count = links;
+}
+
+static uint64_t pick_file_size(generator* gen) {
+    generator_options* options = gen->options;
+    if (options->file_size_max <= options->file_size_min) {
+        return options->file_size_min;
+    }
+    if (options->distribution == SIZE_LOG) {
+        // uniform in log space with 16 bit resolution
+        double low = options->file_size_min > 0 ? (double)options->file_size_min : 1.0;
+        double ratio = (double)options->file_size_max / low;
+        double t = (double)random_below(&gen->random, 65536) / 65535.0;
+        double size = low;
+        // ratio^t bit by bit, repeated square roots give ratio^(1/2), ratio^(1/4), ...
+        double root = ratio;
+        double fraction = t;
+        for (int i = 0; i < 24; i++) {
+            root = __builtin_sqrt(root);
+            fraction *= 2;
+            if (fraction >= 1) {
+                size *= root;
+                fraction -= 1;
+            }
+        }
+        return (uint64_t)size;
+    }
+    return options->file_size_min + random_below(&gen->random, options->file_size_max - options->file_size_min + 1);
+}
+
+// creates a regular file in group, returns its inode or 0 when the image is full
+static uint32_t create_file(generator* gen, uint32_t group) {
+    uint64_t size = pick_file_size(gen);
+    uint64_t block_count = (size + gen->block_size - 1) / gen->block_size;
+    uint64_t max_blocks = 1ULL << 32; // block_count_512 is 32 bits
+    if (blocks_with_pointers(gen, block_count) * (gen->block_size / 512) >= max_blocks or blocks_with_pointers(gen, block_count) + 64 > gen->free_blocks) {
+        gen->full = true;
+        return 0;
+    }
+    uint32_t number = allocate_inode(gen, group);
+    if (number == 0) {
+        gen->full = true;
+        return 0;
+    }
+
+    ext2_inode inode;
+    init_inode(&inode, EXT2_I_FTYPE | EXT2_I_FPERM, 1);
+    inode.size = (uint32_t)size;
+    inode.padding[2] = (uint32_t)(size >> 32); // size_high
+    if (size >> 31) {
+        gen->large_file = true;
+    }
+
+    // data near the inode
+    uint32_t goal = group_first_block(gen, group);
+    std::vector<uint32_t> data;
+    if (!map_blocks(gen, &inode, block_count, goal, &data)) {
+        printf("Error: the image filled up while writing a file\n");
+        exit(1);
+    }
+    std::vector<uint8_t> block(gen->block_size);
+    for (uint64_t i = 0; i < data.size(); i++) {
+        fill_file_block(gen, block.data(), size - i * gen->block_size);
+        write_block(gen, data[i], block.data());
+    }
+    write_inode(gen, number, &inode);
+    gen->files++;
+    gen->data_bytes += size;
+    return number;
+}
+
+struct directory_entry {
+    uint32_t inode;
+    uint8_t file_type;
+    std::string name;
+};
+
+static uint32_t entry_length(size_t name_length) {
+    return (8 + name_length + 3) / 4 * 4;
+}
+
+// writes the entries as directory blocks of inode, the last entry of a block takes its rest
+static void write_directory(generator* gen, uint32_t number, ext2_inode* inode, const std::vector<directory_entry>& entries) {
+    std::vector<std::vector<uint8_t>> blocks;
+    std::vector<uint32_t> last_entry; // offset of the last entry in each block
+    uint32_t offset = gen->block_size;
+    for (const directory_entry& entry : entries) {
+        uint32_t length = entry_length(entry.name.size());
+        if (offset + length > gen->block_size) {
+            blocks.push_back(std::vector<uint8_t>(gen->block_size, 0));
+            last_entry.push_back(0);
+            offset = 0;
+        }
+        uint8_t* at = blocks.back().data() + offset;
+        ext2_dir_entry* dir_entry = (ext2_dir_entry*)at;
+        dir_entry->inode = entry.inode;
+        dir_entry->length = length;
+        dir_entry->name_length = entry.name.size();
+        dir_entry->file_type = entry.file_type;
+        memcpy(dir_entry->name, entry.name.data(), entry.name.size());
+        last_entry.back() = offset;
+        offset += length;
+    }
+    for (size_t i = 0; i < blocks.size(); i++) {
+        ext2_dir_entry* dir_entry = (ext2_dir_entry*)(blocks[i].data() + last_entry[i]);
+        dir_entry->length = gen->block_size - last_entry[i];
+    }
+
+    std::vector<uint32_t> data;
+    if (!map_blocks(gen, inode, blocks.size(), group_first_block(gen, inode_group(gen, number)), &data)) {
+        printf("Error: the image filled up while writing a directory\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < data.size(); i++) {
+        write_block(gen, data[i], blocks[i].data());
+    }
+    inode->size = blocks.size() * gen->block_size;
+    write_inode(gen, number, inode);
+}
+
+// fills directory number (child of parent) with files and, above the last level, subdirectories
+static void create_directory(generator* gen, uint32_t number, uint32_t parent, uint32_t level, std::vector<directory_entry> extra) {
+    generator_options* options = gen->options;
+    uint32_t group = inode_group(gen, number);
+    std::vector<directory_entry> entries;
+    entries.push_back({ number, EXT2_D_DTYPE, "." });
+    entries.push_back({ parent, EXT2_D_DTYPE, ".." });
+    for (directory_entry& entry : extra) {
+        entries.push_back(entry);
+    }
+
+    for (uint32_t i = 0; i < options->files_per_directory and !gen->full; i++) {
+        uint32_t file = create_file(gen, group);
+        if (file != 0) {
+            entries.push_back({ file, EXT2_D_FTYPE, "file" + std::to_string(i) });
+        }
+    }
+
+    std::vector<uint32_t> subdirectories;
+    if (level < options->depth) {
+        for (uint32_t i = 0; i < options->fanout and !gen->full; i++) {
+            uint32_t subdirectory = allocate_inode(gen, gen->next_directory_group++ % gen->group_count);
+            if (subdirectory == 0 or gen->free_blocks < 64) {
+                gen->full = true;
+                break;
+            }
+            subdirectories.push_back(subdirectory);
+            entries.push_back({ subdirectory, EXT2_D_DTYPE, "dir" + std::to_string(i) });
+        }
+    }
+
+    ext2_inode inode;
+    init_inode(&inode, EXT2_I_DTYPE | EXT2_I_DPERM, 2 + subdirectories.size() + (number == EXT2_ROOT_INODE ? 1 : 0));
+    write_directory(gen, number, &inode, entries);
+    gen->bgdt[group].used_dirs_count++;
+    gen->directories++;
+
+    for (uint32_t subdirectory : subdirectories) {
+        create_directory(gen, subdirectory, number, level + 1, std::vector<directory_entry>());
+    }
+}
+
+static void write_metadata(generator* gen) {
+    // bitmaps, padding bits after the last inode and block are set
+    for (uint32_t group = 0; group < gen->group_count; group++) {
+        std::vector<uint8_t> bitmap(gen->block_size, 0xff);
+        uint32_t blocks = group_blocks(gen, group);
+        uint32_t free_blocks = 0;
+        for (uint32_t i = 0; i < blocks; i++) {
+            uint64_t bit = (uint64_t)group * gen->blocks_per_group + i;
+            if ((gen->block_bitmap[bit / 8] >> (bit % 8)) & 1) {
+                continue;
+            }
+            bitmap[i / 8] &= ~(1 << (i % 8));
+            free_blocks++;
+        }
+        write_at(gen, bitmap.data(), gen->block_size, (uint64_t)gen->bgdt[group].block_bitmap * gen->block_size);
+
+        std::fill(bitmap.begin(), bitmap.end(), 0xff);
+        uint32_t free_inodes = 0;
+        for (uint32_t i = 0; i < gen->inodes_per_group; i++) {
+            uint64_t bit = (uint64_t)group * gen->inodes_per_group + i;
+            if ((gen->inode_bitmap[bit / 8] >> (bit % 8)) & 1) {
+                continue;
+            }
+            bitmap[i / 8] &= ~(1 << (i % 8));
+            free_inodes++;
+        }
+        write_at(gen, bitmap.data(), gen->block_size, (uint64_t)gen->bgdt[group].inode_bitmap * gen->block_size);
+
+        gen->bgdt[group].free_block_count = free_blocks;
+        gen->bgdt[group].free_inode_count = free_inodes;
+    }
+
+    ext2_super_block super_block;
+    memset(&super_block, 0, sizeof(super_block));
+    super_block.inode_count = gen->group_count * gen->inodes_per_group;
+    super_block.block_count = gen->block_count;
+    super_block.free_block_count = gen->free_blocks;
+    super_block.free_inode_count = gen->free_inodes;
+    super_block.first_data_block = gen->first_data_block;
+    super_block.log_block_size = __builtin_ctz(gen->block_size) - 10;
+    super_block.log_fragment_size = super_block.log_block_size;
+    super_block.blocks_per_group = gen->blocks_per_group;
+    super_block.fragments_per_group = gen->blocks_per_group;
+    super_block.inodes_per_group = gen->inodes_per_group;
+    super_block.write_time = GENERATOR_TIME;
+    super_block.max_mount_count = 0xffff;
+    super_block.magic = EXT2_SUPER_MAGIC;
+    super_block.state = 1; // clean
+    super_block.errors = 1; // continue
+    super_block.last_check_time = GENERATOR_TIME;
+    super_block.rev_level = 1;
+    super_block.first_inode = EXT2_FIRST_INODE;
+    super_block.inode_size = EXT2_INODE_SIZE;
+    super_block.feature_incompat = EXT2_FEATURE_INCOMPAT_FILETYPE;
+    super_block.feature_ro_compat = EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER | (gen->large_file ? EXT2_FEATURE_RO_COMPAT_LARGE_FILE : 0);
+    random_state uuid_random;
+    seed_random(&uuid_random, gen->options->seed ^ 0x5555);
+    for (int i = 0; i < 16; i++) {
+        super_block.uuid[i] = next_random(&uuid_random);
+    }
+    strncpy(super_block.volume_name, "ext2gen", sizeof(super_block.volume_name));
+
+    // primary copy and the backups of the sparse groups
+    std::vector<uint8_t> table((size_t)gen->bgdt_blocks * gen->block_size, 0);
+    memcpy(table.data(), gen->bgdt.data(), gen->group_count * sizeof(ext2_block_group_descriptor));
+    for (uint32_t group = 0; group < gen->group_count; group++) {
+        if (!group_has_super_block(group)) {
+            continue;
+        }
+        uint64_t first = (uint64_t)group_first_block(gen, group) * gen->block_size;
+        super_block.block_group_nr = group;
+        // the super block is always 1024 bytes into its group, after the boot block in group 0
+        uint64_t super_offset = group == 0 ? EXT2_SUPER_BLOCK_POSITION : first;
+        write_at(gen, &super_block, sizeof(super_block), super_offset);
+        write_at(gen, table.data(), table.size(), ((uint64_t)group_first_block(gen, group) + 1) * gen->block_size);
+    }
+}
+
+static int create_image(const char* path, generator_options* options) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("Error: failed to create %s\n", path);
+        return 1;
+    }
+    generator gen;
+    gen.fd = fd;
+    gen.options = options;
+    seed_random(&gen.random, options->seed);
+    gen.next_directory_group = 1;
+    gen.large_file = false;
+    gen.full = false;
+    gen.run_count = 0;
+    gen.files = 0;
+    gen.directories = 0;
+    gen.data_bytes = 0;
+    if (!plan_layout(&gen)) {
+        close(fd);
+        return 1;
+    }
+    gen.run.resize(WRITE_RUN_SIZE);
+    // unwritten blocks stay holes
+    if (ftruncate(fd, (off_t)gen.block_count * gen.block_size) != 0) {
+        printf("Error: failed to size %s\n", path);
+        close(fd);
+        return 1;
+    }
+
+    // inodes 1 to 10 are reserved, 11 is lost+found
+    for (uint32_t i = 1; i < EXT2_FIRST_INODE; i++) {
+        allocate_inode(&gen, 0);
+    }
+    uint32_t lost_found = allocate_inode(&gen, 0);
+    ext2_inode inode;
+    init_inode(&inode, EXT2_I_DTYPE | 0700, 2);
+    std::vector<directory_entry> lost_found_entries = { { lost_found, EXT2_D_DTYPE, "." }, { EXT2_ROOT_INODE, EXT2_D_DTYPE, ".." } };
+    write_directory(&gen, lost_found, &inode, lost_found_entries);
+    gen.bgdt[0].used_dirs_count++;
+
+    create_directory(&gen, EXT2_ROOT_INODE, EXT2_ROOT_INODE, 0, { { lost_found, EXT2_D_DTYPE, "lost+found" } });
+    flush_run(&gen);
+    write_metadata(&gen);
+    if (fsync(fd) != 0 or close(fd) != 0) {
+        printf("Error: failed to write %s\n", path);
+        return 1;
+    }
+
+    printf("%s: %u blocks of %u bytes, %u groups, %u inodes per group\n", path, gen.block_count, gen.block_size, gen.group_count, gen.inodes_per_group);
+    printf("%lu directories, %lu files, %lu bytes of file data%s\n", (unsigned long)gen.directories, (unsigned long)gen.files, (unsigned long)gen.data_bytes,
+        gen.full ? " (stopped early, the image is full)" : "");
+    return 0;
+}
+
+// corruptors, each reproduces one of the test variants
+struct image_reader {
+    int fd;
+    ext2_super_block super_block;
+    std::vector<ext2_block_group_descriptor> bgdt;
+    uint32_t block_size;
+    uint32_t group_count;
+};
+
+static bool read_at(int fd, void* buffer, size_t length, uint64_t offset) {
+    return pread(fd, buffer, length, offset) == (ssize_t)length;
+}
+
+static bool open_image(image_reader* reader, const char* path) {
+    reader->fd = open(path, O_RDWR);
+    if (reader->fd < 0 or !read_at(reader->fd, &reader->super_block, sizeof(reader->super_block), EXT2_SUPER_BLOCK_POSITION) or reader->super_block.magic != EXT2_SUPER_MAGIC) {
+        printf("Error: %s is not an ext2 image\n", path);
+        return false;
+    }
+    reader->block_size = EXT2_UNLOG(reader->super_block.log_block_size);
+    reader->group_count = (reader->super_block.inode_count + reader->super_block.inodes_per_group - 1) / reader->super_block.inodes_per_group;
+    reader->bgdt.resize(reader->group_count);
+    return read_at(reader->fd, reader->bgdt.data(), reader->group_count * sizeof(ext2_block_group_descriptor), ((uint64_t)reader->super_block.first_data_block + 1) * reader->block_size);
+}
+
+// zeros the real bits of every bitmap of one kind, the padding stays as it is
+static void wipe_bitmaps(image_reader* reader, bool inodes) {
+    uint32_t bits = inodes ? reader->super_block.inodes_per_group : reader->super_block.blocks_per_group;
+    std::vector<uint8_t> zeros((bits + 7) / 8, 0);
+    for (uint32_t group = 0; group < reader->group_count; group++) {
+        uint32_t block = inodes ? reader->bgdt[group].inode_bitmap : reader->bgdt[group].block_bitmap;
+        pwrite(reader->fd, zeros.data(), zeros.size(), (uint64_t)block * reader->block_size);
+    }
+}
+
+// drops count pointers: direct_blocks[0] of directories and the first indirect pointer of large files
+static uint32_t drop_pointers(image_reader* reader, uint32_t count, uint64_t seed) {
+    ext2_super_block* super_block = &reader->super_block;
+    std::vector<uint32_t> candidates;
+    ext2_inode inode;
+    for (uint32_t group = 0; group < reader->group_count; group++) {
+        for (uint32_t i = 0; i < super_block->inodes_per_group; i++) {
+            uint32_t number = group * super_block->inodes_per_group + i + 1;
+            if (number < super_block->first_inode) { // the root keeps its blocks
+                continue;
+            }
+            uint64_t offset = (uint64_t)reader->bgdt[group].inode_table * reader->block_size + (uint64_t)i * super_block->inode_size;
+            if (!read_at(reader->fd, &inode, sizeof(inode), offset) or inode.link_count == 0) {
+                continue;
+            }
+            bool directory = (inode.mode & 0xf000) == EXT2_I_DTYPE and inode.direct_blocks[0] != 0 and number != EXT2_LOST_FOUND_INODE;
+            bool indirect = (inode.mode & 0xf000) == EXT2_I_FTYPE and inode.single_indirect != 0;
+            if (directory or indirect) {
+                candidates.push_back(number);
+            }
+        }
+    }
+
+    random_state random;
+    seed_random(&random, seed);
+    uint32_t dropped = 0;
+    for (; dropped < count and !candidates.empty(); dropped++) {
+        size_t pick = random_below(&random, candidates.size());
+        uint32_t number = candidates[pick];
+        candidates[pick] = candidates.back();
+        candidates.pop_back();
+
+        uint32_t group = (number - 1) / super_block->inodes_per_group;
+        uint32_t i = (number - 1) % super_block->inodes_per_group;
+        uint64_t offset = (uint64_t)reader->bgdt[group].inode_table * reader->block_size + (uint64_t)i * super_block->inode_size;
+        read_at(reader->fd, &inode, sizeof(inode), offset);
+        if ((inode.mode & 0xf000) == EXT2_I_DTYPE) {
+            inode.direct_blocks[0] = 0;
+        }
+        else if (inode.double_indirect != 0 and random_below(&random, 2) == 1) {
+            inode.double_indirect = 0;
+        }
+        else {
+            inode.single_indirect = 0;
+        }
+        pwrite(reader->fd, &inode, sizeof(inode), offset);
+    }
+    return dropped;
+}
+
+static int corrupt_image(int argc, char* argv[]) {
+    bool inode_bitmaps = false;
+    bool block_bitmaps = false;
+    uint32_t pointers = 0;
+    uint64_t seed = 1;
+    const char* path = NULL;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--inode-bitmaps") == 0) {
+            inode_bitmaps = true;
+        }
+        else if (strcmp(argv[i], "--block-bitmaps") == 0) {
+            block_bitmaps = true;
+        }
+        else if (strcmp(argv[i], "--pointers") == 0 and i + 1 < argc) {
+            pointers = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--seed") == 0 and i + 1 < argc) {
+            seed = strtoull(argv[++i], NULL, 10);
+        }
+        else if (argv[i][0] != '-' and path == NULL) {
+            path = argv[i];
+        }
+        else {
+            printf("Error: unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (path == NULL) {
+        printf("Usage: ext2gen corrupt [--inode-bitmaps] [--block-bitmaps] [--pointers N] [--seed N] <image>\n");
+        return 1;
+    }
+
+    image_reader reader;
+    if (!open_image(&reader, path)) {
+        return 1;
+    }
+    if (inode_bitmaps) {
+        wipe_bitmaps(&reader, true);
+    }
+    if (block_bitmaps) {
+        wipe_bitmaps(&reader, false);
+    }
+    if (pointers > 0) {
+        printf("dropped %u pointers\n", drop_pointers(&reader, pointers, seed));
+    }
+    fsync(reader.fd);
+    close(reader.fd);
+    return 0;
+}
+
+static int create_command(int argc, char* argv[]) {
+    generator_options options;
+    options.size = 64ULL << 20;
+    options.block_size = 1024;
+    options.group_count = 0;
+    options.inodes_per_group = 0;
+    options.fanout = 4;
+    options.depth = 3;
+    options.files_per_directory = 8;
+    options.file_size_min = 1024;
+    options.file_size_max = 256 << 10;
+    options.distribution = SIZE_LOG;
+    options.fragmentation = 0;
+    memset(options.identifier, 0, sizeof(options.identifier));
+    options.identifier[0] = 1; // the identifier of the test images
+    options.seed = 1;
+
+    const char* path = NULL;
+    for (int i = 0; i < argc; i++) {
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        bool ok = true;
+        if (argv[i][0] != '-' and path == NULL) {
+            path = argv[i];
+            continue;
+        }
+        else if (value == NULL) {
+            ok = false;
+        }
+        else if (strcmp(argv[i], "--size") == 0) {
+            ok = parse_size(value, &options.size);
+        }
+        else if (strcmp(argv[i], "--block-size") == 0) {
+            options.block_size = atoi(value);
+            ok = options.block_size == 1024 or options.block_size == 2048 or options.block_size == 4096;
+        }
+        else if (strcmp(argv[i], "--groups") == 0) {
+            options.group_count = atoi(value);
+        }
+        else if (strcmp(argv[i], "--inodes-per-group") == 0) {
+            options.inodes_per_group = atoi(value);
+        }
+        else if (strcmp(argv[i], "--fanout") == 0) {
+            options.fanout = atoi(value);
+        }
+        else if (strcmp(argv[i], "--depth") == 0) {
+            options.depth = atoi(value);
+        }
+        else if (strcmp(argv[i], "--files") == 0) {
+            options.files_per_directory = atoi(value);
+        }
+        else if (strcmp(argv[i], "--file-size") == 0) {
+            // MIN:MAX or one size
+            std::string text = value;
+            size_t colon = text.find(':');
+            ok = parse_size(text.substr(0, colon).c_str(), &options.file_size_min);
+            options.file_size_max = options.file_size_min;
+            if (ok and colon != std::string::npos) {
+                ok = parse_size(text.substr(colon + 1).c_str(), &options.file_size_max) and options.file_size_max >= options.file_size_min;
+            }
+        }
+        else if (strcmp(argv[i], "--distribution") == 0) {
+            ok = strcmp(value, "uniform") == 0 or strcmp(value, "log") == 0;
+            options.distribution = strcmp(value, "uniform") == 0 ? SIZE_UNIFORM : SIZE_LOG;
+        }
+        else if (strcmp(argv[i], "--fragmentation") == 0) {
+            options.fragmentation = atoi(value);
+            ok = options.fragmentation <= 100;
+        }
+        else if (strcmp(argv[i], "--identifier") == 0) {
+            ok = parse_identifier_text(value, options.identifier);
+        }
+        else if (strcmp(argv[i], "--seed") == 0) {
+            options.seed = strtoull(value, NULL, 10);
+        }
+        else {
+            ok = false;
+        }
+        if (!ok) {
+            printf("Error: invalid option %s\n", argv[i]);
+            return 1;
+        }
+        i++;
+    }
+    if (path == NULL) {
+        printf("Usage: ext2gen create [--size N[KMGT]] [--block-size 1024|2048|4096] [--groups N] [--inodes-per-group N]\n"
+               "                      [--fanout N] [--depth N] [--files N] [--file-size MIN:MAX] [--distribution uniform|log]\n"
+               "                      [--fragmentation PERCENT] [--identifier \"01 00 ...\"] [--seed N] <image>\n");
+        return 1;
+    }
+    return create_image(path, &options);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc >= 2 and strcmp(argv[1], "create") == 0) {
+        return create_command(argc - 2, argv + 2);
+    }
+    if (argc >= 2 and strcmp(argv[1], "corrupt") == 0) {
+        return corrupt_image(argc - 2, argv + 2);
+    }
+    printf("Usage: %s create [options] <image>\n       %s corrupt [options] <image>\n", argv[0], argv[0]);
+    return 1;
+}
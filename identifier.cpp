@@ -1,5 +1,12 @@
 #include "identifier.h"
 
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define IDENTIFIER_X86
+#endif
+
 uint8_t* parse_identifier(int argc, char* argv[])
 {
 	size_t identifier_length = argc - 2;
@@ -11,3 +18,165 @@ uint8_t* parse_identifier(int argc, char* argv[])
 	}
 	return identifier;
 }
+
+typedef bool (*signature_kernel)(const uint8_t* header, const signature* candidate);
+
+static bool signature_equal_scalar(const uint8_t* header, const signature* candidate) {
+	for (int i = 0; i < SIGNATURE_SIZE; i++) {
+		if ((header[i] ^ candidate->bytes[i]) & candidate->mask[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+#ifdef IDENTIFIER_X86
+__attribute__((target("sse2")))
+static bool signature_equal_sse2(const uint8_t* header, const signature* candidate) {
+	__m128i difference_low = _mm_xor_si128(_mm_loadu_si128((const __m128i*)header), _mm_loadu_si128((const __m128i*)candidate->bytes));
+	__m128i difference_high = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(header + 16)), _mm_loadu_si128((const __m128i*)(candidate->bytes + 16)));
+	difference_low = _mm_and_si128(difference_low, _mm_loadu_si128((const __m128i*)candidate->mask));
+	difference_high = _mm_and_si128(difference_high, _mm_loadu_si128((const __m128i*)(candidate->mask + 16)));
+	__m128i any = _mm_or_si128(difference_low, difference_high);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) == 0xffff;
+}
+
+__attribute__((target("avx2")))
+static bool signature_equal_avx2(const uint8_t* header, const signature* candidate) {
+	__m256i difference = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)header), _mm256_loadu_si256((const __m256i*)candidate->bytes));
+	__m256i mask = _mm256_loadu_si256((const __m256i*)candidate->mask);
+	return _mm256_testz_si256(difference, mask);
+}
+#endif
+
+static signature_kernel pick_signature_kernel() {
+#ifdef IDENTIFIER_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return signature_equal_avx2;
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		return signature_equal_sse2;
+	}
+#endif
+	return signature_equal_scalar;
+}
+
+static const signature_kernel signature_equal = pick_signature_kernel();
+
+static uint64_t header_hash(const uint8_t* header) {
+	uint64_t words[SIGNATURE_SIZE / 8];
+	memcpy(words, header, sizeof(words));
+	uint64_t hash = 0x9e3779b97f4a7c15ULL;
+	for (size_t i = 0; i < SIGNATURE_SIZE / 8; i++) {
+		hash ^= words[i];
+		hash *= 0xff51afd7ed558ccdULL;
+		hash ^= hash >> 33;
+	}
+	return hash;
+}
+
+void signature_index_init(signature_index* index) {
+	index->signatures.clear();
+	index->masked.clear();
+	index->buckets.clear();
+	index->hashed = false;
+}
+
+bool signature_index_add(signature_index* index, const uint8_t* bytes, size_t length) {
+	if (length == 0 or index->signatures.size() >= SIGNATURE_MAX) {
+		return false;
+	}
+	signature added;
+	memset(&added, 0, sizeof(added));
+	for (size_t i = 0; i < length and i < SIGNATURE_SIZE; i++) {
+		added.bytes[i] = bytes[i];
+		added.mask[i] = 0xff;
+	}
+	index->signatures.push_back(added);
+	return true;
+}
+
+bool signature_index_add_hex(signature_index* index, const char* text) {
+	uint8_t bytes[SIGNATURE_SIZE];
+	size_t length = 0;
+	int consumed;
+	unsigned int temp;
+	while (length < SIGNATURE_SIZE and sscanf(text, " %x%n", &temp, &consumed) == 1) {
+		bytes[length++] = (uint8_t)temp;
+		text += consumed;
+	}
+	return signature_index_add(index, bytes, length);
+}
+
+bool signature_index_load(signature_index* index, const char* path) {
+	FILE* file = fopen(path, "r");
+	if (file == NULL) {
+		printf("Error: failed to open identifier file %s\n", path);
+		return false;
+	}
+	char line[1024];
+	while (fgets(line, sizeof(line), file) != NULL) {
+		if (strspn(line, " \t\r\n") == strlen(line)) {
+			continue;
+		}
+		if (!signature_index_add_hex(index, line)) {
+			if (index->signatures.size() >= SIGNATURE_MAX) {
+				printf("Error: more than %d identifiers with %s\n", SIGNATURE_MAX, path);
+			}
+			else {
+				printf("Error: invalid identifier line in %s: %s", path, line);
+			}
+			fclose(file);
+			return false;
+		}
+	}
+	fclose(file);
+	return true;
+}
+
+void signature_index_build(signature_index* index) {
+	index->masked.clear();
+	index->buckets.clear();
+
+	size_t full = 0;
+	for (const signature& candidate : index->signatures) {
+		full += candidate.mask[SIGNATURE_SIZE - 1] != 0;
+	}
+	index->hashed = full > SIGNATURE_HASH_THRESHOLD;
+
+	for (uint32_t i = 0; i < index->signatures.size(); i++) {
+		const signature& candidate = index->signatures[i];
+		if (index->hashed and candidate.mask[SIGNATURE_SIZE - 1] != 0) {
+			index->buckets[header_hash(candidate.bytes)].push_back(i);
+		}
+		else {
+			index->masked.push_back(i);
+		}
+	}
+}
+
+int signature_match(const signature_index* index, const uint8_t* header) {
+	int best = -1;
+	if (index->hashed) {
+		auto found = index->buckets.find(header_hash(header));
+		if (found != index->buckets.end()) {
+			for (uint32_t i : found->second) {
+				if (signature_equal(header, &index->signatures[i])) {
+					best = i;
+					break;
+				}
+			}
+		}
+	}
+	// lowest index wins so the result does not depend on whether the set is hashed
+	for (uint32_t i : index->masked) {
+		if (best >= 0 and (int)i > best) {
+			break;
+		}
+		if (signature_equal(header, &index->signatures[i])) {
+			return i;
+		}
+	}
+	return best;
+}
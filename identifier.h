@@ -3,7 +3,47 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <vector>
+#include <unordered_map>
 
 uint8_t* parse_identifier(int argc, char* argv[]);
 
+// user file blocks start with their owner's identifier, only the first SIGNATURE_SIZE bytes are compared
+#define SIGNATURE_SIZE 32
+// above this many full length identifiers block headers are looked up by hash instead of compared one by one
+#define SIGNATURE_HASH_THRESHOLD 16
+// the classification map keeps the identifier index in 13 bits
+#define SIGNATURE_MAX 8191
+
+struct signature {
+    uint8_t bytes[SIGNATURE_SIZE];
+    uint8_t mask[SIGNATURE_SIZE]; // 0xff for the bytes the identifier defines, 0 past its end
+};
+
+// every identifier we recover for, matched against block headers in one pass
+struct signature_index {
+    std::vector<signature> signatures;
+    std::vector<uint32_t> masked; // identifiers shorter than SIGNATURE_SIZE, always compared
+    std::unordered_map<uint64_t, std::vector<uint32_t>> buckets; // header hash -> full length identifiers
+    bool hashed;
+};
+
+void signature_index_init(signature_index* index);
+
+// false if length is 0 or there are already SIGNATURE_MAX identifiers
+bool signature_index_add(signature_index* index, const uint8_t* bytes, size_t length);
+
+// "01 00 ff ..." or "0x01 00 ..." like the identifier files, false if nothing could be parsed
+bool signature_index_add_hex(signature_index* index, const char* text);
+
+// one identifier per line, empty lines are skipped
+bool signature_index_load(signature_index* index, const char* path);
+
+// call once after adding, builds the hash buckets for large sets
+void signature_index_build(signature_index* index);
+
+// index of the first identifier the header starts with, -1 if none
+// header has to hold SIGNATURE_SIZE bytes
+int signature_match(const signature_index* index, const uint8_t* header);
+
 #endif // !IDENTIFIER_H
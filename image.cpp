@@ -0,0 +1,416 @@
+#include "image.h"
+#include "block_cache.h"
+#include "dirty_set.h"
+#include "overlay.h"
+#include "stats.h"
+#include "thread_pool.h"
+#include "zero_scan.h"
+#include "arena.h"
+
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// asks the filesystem where the data of a sparse file is, one extent covering the file if it cannot say
+static void find_data_extents(ext2_image* image) {
+    int fd = fileno(image->file);
+    uint64_t position = 0;
+    while (position < image->size) {
+        off_t start = lseek(fd, position, SEEK_DATA);
+        if (start < 0) {
+            if (errno != ENXIO) { // ENXIO means only a hole is left
+                image->data_extents.assign(1, std::make_pair((uint64_t)0, image->size));
+            }
+            return;
+        }
+        off_t end = lseek(fd, start, SEEK_HOLE);
+        if (end < 0) {
+            end = image->size;
+        }
+        image->data_extents.push_back(std::make_pair((uint64_t)start, (uint64_t)end));
+        position = end;
+    }
+}
+
+ext2_image* image_open(const char* path, bool writable, bool use_map) {
+    FILE* file = fopen(path, writable ? "r+" : "r");
+    if (file == NULL) {
+        printf("Error: failed to open image %s\n", path);
+        return NULL;
+    }
+
+    ext2_image* image = new ext2_image;
+    image->file = file;
+    image->map = NULL;
+    image->cache = NULL;
+    image->dirty = NULL;
+    image->overlay = NULL;
+    image->size = 0;
+    image->block_size = EXT2_BOOT_BLOCK_SIZE; // until the super block is read
+    image->scan_depth = SCAN_DEFAULT_DEPTH;
+    image->scan_engine = SCAN_ENGINE_AUTO;
+    image->direct_fd = -1;
+    image->hole_bytes = 0;
+    image->writable = writable;
+
+    struct stat st;
+    if (fstat(fileno(file), &st) == 0) {
+        image->size = st.st_size;
+    }
+
+    find_data_extents(image);
+
+    // map the whole image, fall back to stdio if that is not possible (pipes, huge images on 32 bit, ...)
+    if (use_map and image->size > 0) {
+        // read-only even for repair, writes go through pwrite and a shared mapping sees them
+        void* map = mmap(NULL, image->size, PROT_READ, MAP_SHARED, fileno(file), 0);
+        if (map != MAP_FAILED) {
+            image->map = (uint8_t*)map;
+        }
+    }
+
+    return image;
+}
+
+void image_close(ext2_image* image) {
+    if (image == NULL) {
+        return;
+    }
+    if (image->map != NULL) {
+        munmap(image->map, image->size);
+    }
+    block_cache_destroy(image->cache);
+    dirty_set_destroy(image->dirty); // writes that were not committed are dropped
+    if (image->direct_fd >= 0) {
+        close(image->direct_fd);
+    }
+    fclose(image->file);
+    delete image;
+}
+
+void image_set_block_size(ext2_image* image, uint32_t block_size) {
+    image->block_size = block_size;
+    // from here on writes are staged until image_commit
+    if (image->writable and image->dirty == NULL) {
+        image->dirty = dirty_set_create(block_size);
+    }
+}
+
+bool image_set_overlay(ext2_image* image, const char* path) {
+    image->overlay = path;
+    if (image->dirty == NULL) {
+        image->dirty = dirty_set_create(image->block_size);
+    }
+    bool missing;
+    uint64_t image_size;
+    dirty_set* set = overlay_load(path, &missing, &image_size);
+    if (set == NULL) {
+        return missing; // a new overlay
+    }
+    if (set->block_size != image->block_size or image_size != image->size) {
+        printf("Error: overlay %s does not belong to this image\n", path);
+        dirty_set_destroy(set);
+        return false;
+    }
+    // earlier repairs are seen by every reader and are kept when the overlay is saved again
+    dirty_set_destroy(image->dirty);
+    image->dirty = set;
+    return true;
+}
+
+void image_enable_cache(ext2_image* image, size_t budget) {
+    // the mapping already is the cache
+    if (image->map != NULL or image->cache != NULL) {
+        return;
+    }
+    image->cache = block_cache_create(image->block_size, budget);
+}
+
+// pread and pwrite until everything is done, false on error or end of file
+static bool pread_all(int fd, void* buffer, size_t length, uint64_t offset) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t result = pread(fd, (uint8_t*)buffer + done, length - done, offset + done);
+        stats_add(STATS_READ_CALLS, 1);
+        if (result < 0 and errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return false;
+        }
+        stats_add(STATS_BYTES_READ, result);
+        done += result;
+    }
+    return true;
+}
+
+static bool pwrite_all(int fd, const void* buffer, size_t length, uint64_t offset) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t result = pwrite(fd, (const uint8_t*)buffer + done, length - done, offset + done);
+        stats_add(STATS_WRITE_CALLS, 1);
+        if (result < 0 and errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return false;
+        }
+        stats_add(STATS_BYTES_WRITTEN, result);
+        done += result;
+    }
+    return true;
+}
+
+// reads the image as it is on disk, without the staged writes
+static bool read_base(ext2_image* image, uint64_t offset, void* buffer, size_t length) {
+    if (image->map != NULL) {
+        if (offset + length > image->size) {
+            return false;
+        }
+        memcpy(buffer, image->map + offset, length);
+        stats_add(STATS_MAPPED_BYTES, length);
+        return true;
+    }
+
+    // positional reads, recovery workers share the descriptor without a lock
+    return pread_all(fileno(image->file), buffer, length, offset);
+}
+
+// reads what exists of [offset, offset + length) on disk, the rest is zero filled
+static void read_zero_filled(ext2_image* image, uint64_t offset, void* buffer, size_t length) {
+    size_t available = 0;
+    if (offset < image->size) {
+        available = image->size - offset < length ? image->size - offset : length;
+    }
+    if (!read_base(image, offset, buffer, available)) {
+        available = 0;
+    }
+    memset((uint8_t*)buffer + available, 0, length - available);
+}
+
+static bool load_block(void* context, uint32_t block_number, uint8_t* buffer) {
+    ext2_image* image = (ext2_image*)context;
+    read_zero_filled(image, (uint64_t)block_number * image->block_size, buffer, image->block_size);
+    return true;
+}
+
+static bool load_dirty_block(void* context, uint64_t block_number, uint8_t* buffer) {
+    ext2_image* image = (ext2_image*)context;
+    read_zero_filled(image, block_number * image->block_size, buffer, image->block_size);
+    return true;
+}
+
+bool image_read(ext2_image* image, uint64_t offset, void* buffer, size_t length) {
+    if (!read_base(image, offset, buffer, length)) {
+        return false;
+    }
+    if (image->dirty != NULL) {
+        dirty_set_overlay(image->dirty, offset, buffer, length);
+    }
+    return true;
+}
+
+bool image_write(ext2_image* image, uint64_t offset, const void* buffer, size_t length) {
+    if (!image->writable and image->overlay == NULL) {
+        printf("Error: image is opened read-only\n");
+        return false;
+    }
+
+    if (image->dirty != NULL) {
+        return dirty_set_write(image->dirty, offset, buffer, length, load_dirty_block, image);
+    }
+
+    bool ok = pwrite_all(fileno(image->file), buffer, length, offset);
+    if (image->cache != NULL and length > 0) {
+        block_cache_write(image->cache, offset, buffer, length);
+    }
+    return ok;
+}
+
+const void* image_view(ext2_image* image, uint64_t offset, size_t length, void* scratch) {
+    uint64_t block_number = offset / image->block_size;
+    uint32_t block_offset = offset % image->block_size;
+
+    // staged writes hide what is on disk
+    if (image->dirty != NULL and dirty_set_overlaps(image->dirty, offset, length)) {
+        if (block_offset + length <= image->block_size) {
+            const uint8_t* staged = dirty_set_find(image->dirty, block_number);
+            if (staged != NULL) {
+                return staged + block_offset;
+            }
+        }
+        read_zero_filled(image, offset, scratch, length);
+        dirty_set_overlay(image->dirty, offset, scratch, length);
+        return scratch;
+    }
+
+    if (image->map != NULL and offset + length <= image->size) {
+        stats_add(STATS_MAPPED_BYTES, length);
+        return image->map + offset;
+    }
+
+    // metadata views that fit in one block come from the cache
+    if (image->cache != NULL and length > 0 and block_offset + length <= image->block_size and block_number <= UINT32_MAX) {
+        if (block_cache_read(image->cache, block_number, block_offset, scratch, length, load_block, image)) {
+            return scratch;
+        }
+    }
+
+    // whatever lies past the end reads as zeros like a truncated image would
+    read_zero_filled(image, offset, scratch, length);
+    return scratch;
+}
+
+const uint8_t* image_block(ext2_image* image, uint32_t block_number, void* scratch) {
+    uint64_t offset = (uint64_t)block_number * image->block_size;
+    return (const uint8_t*)image_view(image, offset, image->block_size, scratch);
+}
+
+const uint8_t* image_block_pin(ext2_image* image, uint32_t block_number, void* scratch) {
+    if (image->dirty != NULL) {
+        const uint8_t* staged = dirty_set_find(image->dirty, block_number);
+        if (staged != NULL) {
+            return staged;
+        }
+    }
+    if (image->map == NULL and image->cache != NULL) {
+        const uint8_t* cached = block_cache_pin(image->cache, block_number, load_block, image);
+        if (cached != NULL) {
+            return cached;
+        }
+    }
+    return image_block(image, block_number, scratch);
+}
+
+void image_block_unpin(ext2_image* image, const uint8_t* view) {
+    if (image->cache != NULL and view != NULL) {
+        block_cache_unpin(image->cache, view);
+    }
+}
+
+bool image_commit(ext2_image* image, bool dry_run, FILE* report) {
+    if (image->dirty == NULL) {
+        return true;
+    }
+    if (image->overlay != NULL) {
+        return overlay_save(image->overlay, image->dirty, fileno(image->file), image->size, dry_run, report);
+    }
+    if (!dry_run and image->cache != NULL) {
+        std::lock_guard<std::mutex> guard(image->dirty->lock);
+        for (auto& entry : image->dirty->blocks) {
+            block_cache_write(image->cache, entry.first * image->block_size, entry.second, image->block_size);
+        }
+    }
+    return dirty_set_flush(image->dirty, fileno(image->file), dry_run, report);
+}
+
+void image_set_scan(ext2_image* image, unsigned int depth, scan_engine_kind engine) {
+    image->scan_depth = depth;
+    image->scan_engine = engine;
+}
+
+bool image_enable_direct_io(ext2_image* image, const char* path) {
+    int fd = open(path, O_RDONLY | O_DIRECT);
+    if (fd < 0) {
+        return false;
+    }
+    // some filesystems accept the flag and only refuse the reads
+    uint8_t* probe = (uint8_t*)counted_aligned_alloc(SCAN_DIRECT_ALIGNMENT, SCAN_DIRECT_ALIGNMENT);
+    bool ok = probe != NULL and pread(fd, probe, SCAN_DIRECT_ALIGNMENT, 0) >= 0;
+    free(probe);
+    if (!ok) {
+        close(fd);
+        return false;
+    }
+    image->direct_fd = fd;
+    return true;
+}
+
+bool image_is_hole(ext2_image* image, uint64_t offset, size_t length) {
+    // the first extent that ends after offset is the only one that can overlap
+    auto it = std::upper_bound(image->data_extents.begin(), image->data_extents.end(), offset,
+        [](uint64_t value, const std::pair<uint64_t, uint64_t>& extent) { return value < extent.second; });
+    return it == image->data_extents.end() or it->first >= offset + length;
+}
+
+size_t image_scan_chunk_size(ext2_image* image) {
+    return image->direct_fd >= 0 ? DIRECT_SCAN_CHUNK_SIZE : ZERO_SCAN_CHUNK_SIZE;
+}
+
+bool image_scan(ext2_image* image, const std::vector<scan_request>& requests, unsigned int thread_count, const std::function<void(size_t, const uint8_t*)>& consume) {
+    // holes are known to be zero, only the rest is read
+    std::vector<size_t> reads;
+    uint64_t hole_bytes = 0;
+    for (size_t i = 0; i < requests.size(); i++) {
+        if (image_is_hole(image, requests[i].offset, requests[i].length) and (image->dirty == NULL or !dirty_set_overlaps(image->dirty, requests[i].offset, requests[i].length))) {
+            hole_bytes += requests[i].length;
+            consume(i, NULL);
+        }
+        else {
+            reads.push_back(i);
+        }
+    }
+    image->hole_bytes += hole_bytes;
+    stats_add(STATS_HOLE_BYTES, hole_bytes);
+
+    if (image->map == NULL or image->direct_fd >= 0) {
+        bool direct = image->direct_fd >= 0;
+        int fd = direct ? image->direct_fd : fileno(image->file);
+        std::vector<scan_request> read_requests(reads.size());
+        for (size_t i = 0; i < reads.size(); i++) {
+            read_requests[i] = requests[reads[i]];
+        }
+        return async_scan(fd, read_requests, image->scan_depth, thread_count, image->scan_engine, direct, [&](size_t i, uint8_t* data) {
+            if (image->dirty != NULL) {
+                dirty_set_overlay(image->dirty, read_requests[i].offset, data, read_requests[i].length);
+            }
+            consume(reads[i], data);
+        });
+    }
+
+    run_parallel(thread_count, reads.size(), [&](size_t j) {
+        size_t i = reads[j];
+        uint64_t offset = requests[i].offset;
+        size_t length = requests[i].length;
+        // straight from the mapping unless the view needs zero fill or staged blocks
+        if (offset + length <= image->size and (image->dirty == NULL or !dirty_set_overlaps(image->dirty, offset, length))) {
+            stats_add(STATS_MAPPED_BYTES, length);
+            consume(i, image->map + offset);
+            return;
+        }
+        scan_buffer buffer;
+        if (scan_buffer_alloc(&buffer, length)) {
+            consume(i, (const uint8_t*)image_view(image, offset, length, buffer.data));
+            scan_buffer_free(&buffer);
+        }
+    });
+    return true;
+}
+
+void image_prefetch(ext2_image* image, uint32_t block_number) {
+    uint64_t offset = (uint64_t)block_number * image->block_size;
+    if (offset + image->block_size > image->size) {
+        return;
+    }
+    if (image->map != NULL) {
+        // madvise wants a page aligned start
+        uint64_t page_size = sysconf(_SC_PAGESIZE);
+        uint64_t start = offset / page_size * page_size;
+        madvise(image->map + start, offset + image->block_size - start, MADV_WILLNEED);
+    }
+    else {
+        posix_fadvise(fileno(image->file), offset, image->block_size, POSIX_FADV_WILLNEED);
+    }
+}
+
+const ext2_super_block* image_super_block(ext2_image* image, ext2_super_block* scratch) {
+    return (const ext2_super_block*)image_view(image, EXT2_SUPER_BLOCK_POSITION, sizeof(ext2_super_block), scratch);
+}
+
+const ext2_inode* image_inode(ext2_image* image, uint64_t offset, ext2_inode* scratch) {
+    return (const ext2_inode*)image_view(image, offset, sizeof(ext2_inode), scratch);
+}
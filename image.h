@@ -0,0 +1,107 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+#include <vector>
+
+#include "ext2fs.h"
+#include "async_scan.h"
+
+struct block_cache;
+struct dirty_set;
+
+// image access layer
+// the image is mmapped read-only when possible, also for repair
+// and every reader gets pointers straight into the mapping. if the image cannot be mapped
+// positional reads of the file are used instead and views are copied into a caller supplied scratch buffer,
+// going through an LRU block cache for anything that fits in one block
+// writes to a writable image are staged in a dirty set and only reach the file with image_commit,
+// every read sees them before that. with an overlay the image stays read-only and the commit
+// goes to the sidecar file instead
+struct ext2_image {
+    FILE* file; // always open, its descriptor is read with pread when map is NULL
+    uint8_t* map; // NULL if the image could not be mapped
+    block_cache* cache; // NULL when mapped or not enabled
+    dirty_set* dirty; // staged writes, NULL until the block size is known or if read-only
+    const char* overlay; // sidecar path in overlay mode, NULL otherwise
+    uint64_t size; // size of the image file in bytes
+    uint32_t block_size; // set once the super block is read
+    unsigned int scan_depth; // reads in flight during image_scan
+    int direct_fd; // O_DIRECT descriptor for scans, -1 to scan through the page cache
+    std::vector<std::pair<uint64_t, uint64_t>> data_extents; // [start, end) of the file that hold data, the rest are holes
+    std::atomic<uint64_t> hole_bytes; // bytes image_scan skipped because they lie in holes
+    scan_engine_kind scan_engine;
+    bool writable;
+};
+
+// use_map false forces the pread path
+ext2_image* image_open(const char* path, bool writable, bool use_map = true);
+
+void image_close(ext2_image* image);
+
+void image_set_block_size(ext2_image* image, uint32_t block_size);
+
+// keep writes in the overlay at path, blocks already in it are read from there
+// call after image_set_block_size, false if the overlay exists but cannot be used
+bool image_set_overlay(ext2_image* image, const char* path);
+
+// cache single block reads of an unmapped image in budget bytes, needs the block size
+void image_enable_cache(ext2_image* image, size_t budget);
+
+// copy length bytes at offset into buffer, false on short read
+bool image_read(ext2_image* image, uint64_t offset, void* buffer, size_t length);
+
+// write length bytes at offset, false on short write or read-only image
+// staged once the block size is set
+bool image_write(ext2_image* image, uint64_t offset, const void* buffer, size_t length);
+
+// pointer to length bytes at offset
+// into the mapping if mapped, otherwise the bytes are read into scratch and scratch is returned
+const void* image_view(ext2_image* image, uint64_t offset, size_t length, void* scratch);
+
+// view of a whole block, scratch must hold at least block_size bytes
+const uint8_t* image_block(ext2_image* image, uint32_t block_number, void* scratch);
+
+// view of a whole block that stays valid until image_block_unpin, even across other reads
+// cached blocks are pinned so they are not evicted, scratch is used if that is not possible
+const uint8_t* image_block_pin(ext2_image* image, uint32_t block_number, void* scratch);
+
+void image_block_unpin(ext2_image* image, const uint8_t* view);
+
+// writes every staged block to the file in block order and syncs once
+// with dry_run nothing is written, report (if not NULL) gets a summary of the pending blocks
+bool image_commit(ext2_image* image, bool dry_run, FILE* report);
+
+// reads in flight and engine for image_scan on an unmapped image
+void image_set_scan(ext2_image* image, unsigned int depth, scan_engine_kind engine);
+
+// stream scans past the page cache, metadata reads keep using the cached path
+// returns false and keeps cached scans if the filesystem refuses O_DIRECT (tmpfs, some FUSE mounts)
+bool image_enable_direct_io(ext2_image* image, const char* path);
+
+// bytes a scan should ask for per read
+size_t image_scan_chunk_size(ext2_image* image);
+
+// true if [offset, offset + length) is a hole of the image file (or past its end) and reads as zeros
+bool image_is_hole(ext2_image* image, uint64_t offset, size_t length);
+
+// reads every request and calls consume(request, data) for each, with staged writes applied
+// requests that fall in a hole of a sparse image are not read, consume gets NULL for them
+// a mapped image hands out views on thread_count workers, otherwise (or with direct io) the bytes
+// go through the async scan engine. consume may run on several threads at once, false on a read error
+bool image_scan(ext2_image* image, const std::vector<scan_request>& requests, unsigned int thread_count, const std::function<void(size_t, const uint8_t*)>& consume);
+
+// hint that the block will be read soon (madvise on the mapping, fadvise otherwise)
+void image_prefetch(ext2_image* image, uint32_t block_number);
+
+// typed views
+const ext2_super_block* image_super_block(ext2_image* image, ext2_super_block* scratch);
+
+const ext2_inode* image_inode(ext2_image* image, uint64_t offset, ext2_inode* scratch);
+
+#endif // IMAGE_H
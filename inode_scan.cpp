@@ -0,0 +1,123 @@
+#include "inode_scan.h"
+
+#include <string.h>
+#include <stddef.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define INODE_SCAN_X86
+#endif
+
+#define DELETION_TIME_OFFSET offsetof(ext2_inode, deletion_time)
+#define LINK_COUNT_OFFSET offsetof(ext2_inode, link_count)
+
+// live bits of up to 64 inodes, bit i for the inode at table + i * inode_size
+typedef uint64_t (*live_kernel)(const uint8_t* table, uint32_t inode_size, uint32_t count);
+
+static uint64_t live_word_scalar(const uint8_t* table, uint32_t inode_size, uint32_t count) {
+    uint64_t word = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t* inode = table + (size_t)i * inode_size;
+        uint32_t deletion_time;
+        uint16_t link_count;
+        memcpy(&deletion_time, inode + DELETION_TIME_OFFSET, sizeof(deletion_time));
+        memcpy(&link_count, inode + LINK_COUNT_OFFSET, sizeof(link_count));
+        word |= (uint64_t)(link_count != 0 and deletion_time == 0) << i;
+    }
+    return word;
+}
+
+#ifdef INODE_SCAN_X86
+__attribute__((target("avx2")))
+static uint64_t live_word_avx2(const uint8_t* table, uint32_t inode_size, uint32_t count) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i low_half = _mm256_set1_epi32(0xffff);
+    const __m256i stride = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(inode_size));
+    uint64_t word = 0;
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const uint8_t* base = table + (size_t)i * inode_size;
+        __m256i deletion_time = _mm256_i32gather_epi32((const int*)(base + DELETION_TIME_OFFSET), stride, 1);
+        // the 32 bit load also takes the low half of block_count_512, masked off
+        __m256i link_count = _mm256_and_si256(_mm256_i32gather_epi32((const int*)(base + LINK_COUNT_OFFSET), stride, 1), low_half);
+        __m256i live = _mm256_andnot_si256(_mm256_cmpeq_epi32(link_count, zero), _mm256_cmpeq_epi32(deletion_time, zero));
+        word |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(live)) << i;
+    }
+    if (i < count) {
+        word |= live_word_scalar(table + (size_t)i * inode_size, inode_size, count - i) << i;
+    }
+    return word;
+}
+
+__attribute__((target("avx512f")))
+static uint64_t live_word_avx512(const uint8_t* table, uint32_t inode_size, uint32_t count) {
+    const __m512i low_half = _mm512_set1_epi32(0xffff);
+    const __m512i zero = _mm512_setzero_si512(); // gathers are masked with every lane on, gcc 12 warns about the unmasked form with -Wall -O2
+    const __m512i stride = _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15), _mm512_set1_epi32(inode_size));
+    uint64_t word = 0;
+    uint32_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        const uint8_t* base = table + (size_t)i * inode_size;
+        __m512i deletion_time = _mm512_mask_i32gather_epi32(zero, 0xffff, stride, (const void*)(base + DELETION_TIME_OFFSET), 1);
+        __m512i link_count = _mm512_mask_i32gather_epi32(zero, 0xffff, stride, (const void*)(base + LINK_COUNT_OFFSET), 1);
+        __mmask16 live = _mm512_test_epi32_mask(link_count, low_half) & _mm512_testn_epi32_mask(deletion_time, deletion_time);
+        word |= (uint64_t)live << i;
+    }
+    if (i < count) {
+        word |= live_word_scalar(table + (size_t)i * inode_size, inode_size, count - i) << i;
+    }
+    return word;
+}
+#endif
+
+struct live_kernel_choice {
+    live_kernel kernel;
+    const char* name;
+};
+
+static live_kernel_choice pick_live_kernel() {
+#ifdef INODE_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return { live_word_avx512, "avx512" };
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return { live_word_avx2, "avx2" };
+    }
+#endif
+    return { live_word_scalar, "scalar" };
+}
+
+static const live_kernel_choice& live_kernel_selected() {
+    static const live_kernel_choice choice = pick_live_kernel();
+    return choice;
+}
+
+const char* inode_scan_kernel_name() {
+    return live_kernel_selected().name;
+}
+
+void mark_live_inodes(const uint8_t* table, uint32_t inode_size, uint32_t count, bitmap* map, uint64_t first_bit) {
+    live_kernel kernel = live_kernel_selected().kernel;
+    for (uint32_t i = 0; i < count; i += 64) {
+        uint32_t take = count - i < 64 ? count - i : 64;
+        uint64_t word = kernel(table + (size_t)i * inode_size, inode_size, take);
+        if (word == 0) {
+            continue;
+        }
+        // first_bit does not have to be word aligned, the bits then straddle two words
+        uint64_t bit = first_bit + i;
+        uint64_t shift = bit % 64;
+        map->words[bit / 64] |= word << shift;
+        if (shift != 0 and (word >> (64 - shift)) != 0) {
+            map->words[bit / 64 + 1] |= word >> (64 - shift);
+        }
+    }
+}
+
+uint32_t reserved_inode_count(ext2_super_block* super_block) {
+    // revision 0 has no first_inode field, its first free inode is 11
+    uint32_t first_inode = super_block->rev_level == 0 ? 11 : super_block->first_inode;
+    uint32_t reserved = first_inode > 0 ? first_inode - 1 : 0;
+    return reserved < super_block->inodes_per_group ? reserved : super_block->inodes_per_group;
+}
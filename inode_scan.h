@@ -0,0 +1,24 @@
+#ifndef INODE_SCAN_H
+#define INODE_SCAN_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "ext2fs.h"
+#include "bitmap.h"
+
+// inode liveness straight from a raw inode table buffer
+// an inode is live when link_count != 0 and deletion_time == 0, both are read at their fixed offset
+// in every inode_size stride, 16 (AVX-512) or 8 (AVX2) inodes per step, and the live lanes become bits
+// that are ORed into the bitmap a word at a time
+
+// sets bit (first_bit + i) of map for each live inode i among the count inodes of table
+void mark_live_inodes(const uint8_t* table, uint32_t inode_size, uint32_t count, bitmap* map, uint64_t first_bit);
+
+// name of the kernel mark_live_inodes picked, for diagnostics
+const char* inode_scan_kernel_name();
+
+// inodes below first_inode are reserved for the filesystem and always in use
+uint32_t reserved_inode_count(ext2_super_block* super_block);
+
+#endif // INODE_SCAN_H
@@ -0,0 +1,80 @@
+#include "inode_table.h"
+
+bool inode_table_open(inode_table_reader* reader, ext2_image* image, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt, unsigned int group_num) {
+    reader->image = image;
+    reader->table_offset = (uint64_t)bgdt[group_num].inode_table * image->block_size;
+    reader->inode_size = super_block->inode_size;
+    reader->inode_count = super_block->inodes_per_group;
+    reader->chunk = NULL;
+    reader->chunk_first = 0;
+    reader->chunk_loaded = 0;
+    reader->next = 0;
+
+    if (reader->inode_size == 0) {
+        printf("Error: inode size is zero\n");
+        reader->scratch = NULL;
+        return false;
+    }
+
+    reader->chunk_inodes = INODE_TABLE_CHUNK_SIZE / reader->inode_size;
+    if (reader->chunk_inodes == 0) {
+        reader->chunk_inodes = 1;
+    }
+    if (reader->chunk_inodes > reader->inode_count) {
+        reader->chunk_inodes = reader->inode_count;
+    }
+
+    // padded so the last inode of a chunk can be viewed as a full ext2_inode when inode_size is smaller
+    reader->scratch = new uint8_t[(size_t)reader->chunk_inodes * reader->inode_size + sizeof(ext2_inode)];
+    return true;
+}
+
+// loads the chunk starting at reader->next with one sequential read
+static void load_chunk(inode_table_reader* reader) {
+    uint32_t count = reader->inode_count - reader->next;
+    if (count > reader->chunk_inodes) {
+        count = reader->chunk_inodes;
+    }
+    uint64_t offset = reader->table_offset + (uint64_t)reader->next * reader->inode_size;
+    reader->chunk = (const uint8_t*)image_view(reader->image, offset, (size_t)count * reader->inode_size, reader->scratch);
+    reader->chunk_first = reader->next;
+    reader->chunk_loaded = count;
+}
+
+const ext2_inode* inode_table_next(inode_table_reader* reader, uint32_t* index) {
+    if (reader->next >= reader->inode_count) {
+        return NULL;
+    }
+
+    if (reader->next >= reader->chunk_first + reader->chunk_loaded) {
+        load_chunk(reader);
+    }
+
+    *index = reader->next;
+    const uint8_t* inode = reader->chunk + (size_t)(reader->next - reader->chunk_first) * reader->inode_size;
+    reader->next++;
+    return (const ext2_inode*)inode;
+}
+
+const uint8_t* inode_table_next_chunk(inode_table_reader* reader, uint32_t* first, uint32_t* count) {
+    if (reader->next >= reader->inode_count) {
+        return NULL;
+    }
+
+    if (reader->next >= reader->chunk_first + reader->chunk_loaded) {
+        load_chunk(reader);
+    }
+
+    // the rest of the current chunk, from where inode_table_next left off
+    *first = reader->next;
+    *count = reader->chunk_first + reader->chunk_loaded - reader->next;
+    const uint8_t* inodes = reader->chunk + (size_t)(reader->next - reader->chunk_first) * reader->inode_size;
+    reader->next += *count;
+    return inodes;
+}
+
+void inode_table_close(inode_table_reader* reader) {
+    delete[] reader->scratch;
+    reader->scratch = NULL;
+    reader->chunk = NULL;
+}
@@ -0,0 +1,40 @@
+#ifndef INODE_TABLE_H
+#define INODE_TABLE_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "ext2fs.h"
+#include "image.h"
+
+// inodes loaded per sequential read when the image is not mapped
+#define INODE_TABLE_CHUNK_SIZE (1U << 20)
+
+// streams the inode table of one block group in large sequential chunks
+// inodes are returned in place, stepping by super_block->inode_size
+struct inode_table_reader {
+    ext2_image* image;
+    uint64_t table_offset; // byte offset of the group's inode table
+    uint32_t inode_size;
+    uint32_t inode_count; // inodes in the group
+    uint32_t chunk_inodes; // inodes per chunk
+    uint8_t* scratch; // chunk buffer used when the image is not mapped
+    const uint8_t* chunk; // current chunk, into the mapping or scratch
+    uint32_t chunk_first; // index of the first inode in chunk
+    uint32_t chunk_loaded; // number of inodes in chunk
+    uint32_t next; // index of the next inode to return
+};
+
+bool inode_table_open(inode_table_reader* reader, ext2_image* image, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt, unsigned int group_num);
+
+// next inode of the group, index is set to its position in the group (0 based)
+// returns NULL once the whole table is consumed
+const ext2_inode* inode_table_next(inode_table_reader* reader, uint32_t* index);
+
+// next chunk of raw inodes (inode_size apart) instead of one inode, for scans over the whole table
+// first is set to the index of its first inode and count to the inodes in it, NULL once the table is consumed
+const uint8_t* inode_table_next_chunk(inode_table_reader* reader, uint32_t* first, uint32_t* count);
+
+void inode_table_close(inode_table_reader* reader);
+
+#endif // INODE_TABLE_H
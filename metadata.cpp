@@ -0,0 +1,197 @@
+#include "metadata.h"
+#include "inode_table.h"
+#include "inode_scan.h"
+#include "thread_pool.h"
+#include "stats.h"
+
+#include <string.h>
+#include <atomic>
+
+void inode_record_from(const ext2_inode* inode, inode_record* record) {
+    record->mode = inode->mode;
+    record->block_count_512 = inode->block_count_512;
+    record->size = inode_file_size(inode);
+    memcpy(record->pointers, inode->direct_blocks, sizeof(record->pointers));
+}
+
+static bool inode_is_live(const ext2_inode* inode) {
+    return inode->link_count != 0 and inode->deletion_time == 0;
+}
+
+static size_t group_memory(const metadata_group* group) {
+    return group->live.word_count * sizeof(uint64_t) + group->rank.capacity() * sizeof(uint32_t)
+        + group->mode.capacity() * sizeof(uint16_t) + group->block_count_512.capacity() * sizeof(uint32_t)
+        + group->size.capacity() * sizeof(uint64_t) + group->pointers.capacity() * sizeof(uint32_t);
+}
+
+// one pass over the group's inode table, false if it could not be read
+// the live bits of a chunk come from the liveness kernel, only the live inodes are then touched
+static bool load_group(metadata_model* model, ext2_image* image, unsigned int group_num) {
+    metadata_group* group = &model->groups[group_num];
+    bitmap_init(&group->live, model->super_block->inodes_per_group);
+    inode_table_reader reader;
+    bool ok = inode_table_open(&reader, image, model->super_block, model->bgdt, group_num);
+    if (ok) {
+        // the descriptor's count sizes the columns once, it can be off on a damaged image,
+        // then push_back grows them and shrink_to_fit below trims them
+        uint32_t free_inodes = model->bgdt[group_num].free_inode_count;
+        size_t expected = free_inodes < model->super_block->inodes_per_group ? model->super_block->inodes_per_group - free_inodes : 0;
+        group->mode.reserve(expected);
+        group->block_count_512.reserve(expected);
+        group->size.reserve(expected);
+        group->pointers.reserve(expected * INODE_POINTERS);
+        uint32_t first, count;
+        const uint8_t* chunk;
+        while ((chunk = inode_table_next_chunk(&reader, &first, &count)) != NULL) {
+            mark_live_inodes(chunk, reader.inode_size, count, &group->live, first);
+            for (uint64_t index = bitmap_find_next_set(&group->live, first); index != BITMAP_NONE and index < first + count; index = bitmap_find_next_set(&group->live, index + 1)) {
+                const ext2_inode* inode = (const ext2_inode*)(chunk + (size_t)(index - first) * reader.inode_size);
+                group->mode.push_back(inode->mode);
+                group->block_count_512.push_back(inode->block_count_512);
+                group->size.push_back(inode_file_size(inode));
+                group->pointers.insert(group->pointers.end(), inode->direct_blocks, inode->direct_blocks + INODE_POINTERS);
+            }
+        }
+    }
+    inode_table_close(&reader);
+
+    // exact sizes, slack would otherwise count against the cap
+    group->mode.shrink_to_fit();
+    group->block_count_512.shrink_to_fit();
+    group->size.shrink_to_fit();
+    group->pointers.shrink_to_fit();
+    group->rank.resize(group->live.word_count);
+    uint32_t before = 0;
+    for (size_t i = 0; i < group->live.word_count; i++) {
+        group->rank[i] = before;
+        before += __builtin_popcountll(group->live.words[i]);
+    }
+    return ok;
+}
+
+metadata_model* metadata_load(ext2_image* image, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt, unsigned int group_count, unsigned int thread_count, size_t memory_cap) {
+    metadata_model* model = new metadata_model;
+    model->super_block = super_block;
+    model->bgdt = bgdt;
+    model->group_count = group_count;
+    model->groups.resize(group_count);
+    model->live_count = 0;
+    model->memory = 0;
+
+    // groups that are not loaded yet stay empty once the cap is hit
+    std::atomic<size_t> memory(group_count * sizeof(metadata_group));
+    std::atomic<bool> over_cap(memory > memory_cap);
+    run_parallel(thread_count, group_count, [&](size_t i) {
+        if (over_cap) {
+            return;
+        }
+        load_group(model, image, i);
+        if (memory.fetch_add(group_memory(&model->groups[i])) + group_memory(&model->groups[i]) > memory_cap) {
+            over_cap = true;
+        }
+    });
+    if (over_cap) {
+        fprintf(stderr, "metadata model needs more than %lu MiB, reading the inode tables in each pass instead\n", (unsigned long)(memory_cap >> 20));
+        metadata_free(model);
+        return NULL;
+    }
+
+    model->memory = memory;
+    for (const metadata_group& group : model->groups) {
+        model->live_count += group.mode.size();
+    }
+    stats_add(STATS_METADATA_BYTES, model->memory);
+    return model;
+}
+
+void metadata_free(metadata_model* model) {
+    for (metadata_group& group : model->groups) {
+        if (group.live.words != NULL) {
+            bitmap_free(&group.live);
+        }
+    }
+    delete model;
+}
+
+void metadata_mark_live(metadata_model* model, ext2_image* image, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt, unsigned int group_num, bitmap* into) {
+    if (model != NULL) {
+        bitmap_or_range(into, 0, &model->groups[group_num].live, 0, super_block->inodes_per_group);
+        return;
+    }
+    inode_table_reader reader;
+    if (inode_table_open(&reader, image, super_block, bgdt, group_num)) {
+        uint32_t first, count;
+        const uint8_t* chunk;
+        while ((chunk = inode_table_next_chunk(&reader, &first, &count)) != NULL) {
+            mark_live_inodes(chunk, reader.inode_size, count, into, first);
+        }
+    }
+    inode_table_close(&reader);
+}
+
+static void group_record(const metadata_group* group, uint32_t slot, inode_record* record) {
+    record->mode = group->mode[slot];
+    record->block_count_512 = group->block_count_512[slot];
+    record->size = group->size[slot];
+    memcpy(record->pointers, &group->pointers[(size_t)slot * INODE_POINTERS], sizeof(record->pointers));
+}
+
+static uint32_t group_slot(const metadata_group* group, uint32_t index) {
+    uint64_t below = index % 64 == 0 ? 0 : group->live.words[index / 64] << (64 - index % 64);
+    return group->rank[index / 64] + __builtin_popcountll(below);
+}
+
+void metadata_group_inodes(metadata_model* model, ext2_image* image, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt, unsigned int group_num, const std::function<void(uint32_t, const inode_record&)>& visit) {
+    inode_record record;
+    if (model != NULL) {
+        const metadata_group* group = &model->groups[group_num];
+        uint32_t slot = 0;
+        for (uint64_t index = bitmap_find_next_set(&group->live, 0); index != BITMAP_NONE; index = bitmap_find_next_set(&group->live, index + 1)) {
+            group_record(group, slot++, &record);
+            visit(index, record);
+        }
+        return;
+    }
+    inode_table_reader reader;
+    if (inode_table_open(&reader, image, super_block, bgdt, group_num)) {
+        uint32_t index;
+        const ext2_inode* inode;
+        while ((inode = inode_table_next(&reader, &index)) != NULL) {
+            if (inode_is_live(inode)) {
+                inode_record_from(inode, &record);
+                visit(index, record);
+            }
+        }
+    }
+    inode_table_close(&reader);
+}
+
+bool metadata_inode(metadata_model* model, ext2_image* image, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt, uint32_t inode_number, inode_record* record) {
+    if (inode_number == 0 or inode_number > super_block->inode_count) {
+        return false;
+    }
+    uint32_t group_num = (inode_number - 1) / super_block->inodes_per_group;
+    uint32_t index = (inode_number - 1) % super_block->inodes_per_group;
+    if (model != NULL and bitmap_test(&model->groups[group_num].live, index)) {
+        const metadata_group* group = &model->groups[group_num];
+        group_record(group, group_slot(group, index), record);
+        return true;
+    }
+    // inodes that are not live are not in the model, an entry may still name one
+    ext2_inode scratch;
+    uint64_t offset = (uint64_t)bgdt[group_num].inode_table * image->block_size + (uint64_t)index * super_block->inode_size;
+    inode_record_from(image_inode(image, offset, &scratch), record);
+    return true;
+}
+
+void metadata_set_pointers(metadata_model* model, uint32_t inode_number, const uint32_t* pointers) {
+    if (model == NULL) {
+        return;
+    }
+    uint32_t group_num = (inode_number - 1) / model->super_block->inodes_per_group;
+    uint32_t index = (inode_number - 1) % model->super_block->inodes_per_group;
+    metadata_group* group = &model->groups[group_num];
+    if (bitmap_test(&group->live, index)) {
+        memcpy(&group->pointers[(size_t)group_slot(group, index) * INODE_POINTERS], pointers, sizeof(uint32_t) * INODE_POINTERS);
+    }
+}
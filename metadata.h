@@ -0,0 +1,71 @@
+#ifndef METADATA_H
+#define METADATA_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <functional>
+#include <vector>
+
+#include "ext2fs.h"
+#include "image.h"
+#include "bitmap.h"
+#include "block_map.h"
+
+#define INODE_POINTERS (EXT2_NUM_DIRECT_BLOCKS + BLOCK_MAP_LEVELS) // direct, single, double and triple indirect
+
+// the fields of an inode the recovery passes use
+struct inode_record {
+    uint16_t mode;
+    uint32_t block_count_512;
+    uint64_t size; // with the high 32 bits of regular files
+    uint32_t pointers[INODE_POINTERS]; // same order as in ext2_inode
+};
+
+void inode_record_from(const ext2_inode* inode, inode_record* record);
+
+// live inodes (link_count != 0 and deletion_time == 0) of one group as columns
+// live inode i of the group has slot rank(i): the number of live inodes before it,
+// found from the per word prefix counts and a popcount of the word
+struct metadata_group {
+    bitmap live; // inodes_per_group bits
+    std::vector<uint32_t> rank; // live inodes before each 64 bit word of live
+    std::vector<uint16_t> mode;
+    std::vector<uint32_t> block_count_512;
+    std::vector<uint64_t> size;
+    std::vector<uint32_t> pointers; // INODE_POINTERS per slot
+};
+
+// every inode table read once and kept in compact columns, so the passes over inodes
+// do not read the tables again and a liveness scan touches one bit per inode
+struct metadata_model {
+    ext2_super_block* super_block;
+    ext2_block_group_descriptor* bgdt;
+    unsigned int group_count;
+    std::vector<metadata_group> groups;
+    uint64_t live_count;
+    size_t memory; // bytes held by the columns
+};
+
+// reads every inode table on thread_count threads
+// returns NULL, after a note to stderr, if the columns would need more than memory_cap bytes,
+// the passes then read the inode tables themselves like before
+metadata_model* metadata_load(ext2_image* image, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt, unsigned int group_count, unsigned int thread_count, size_t memory_cap);
+
+void metadata_free(metadata_model* model);
+
+// the functions below take the model or NULL, without a model they read the image
+
+// sets the bits of the group's live inodes in into (bit i is inode i of the group)
+void metadata_mark_live(metadata_model* model, ext2_image* image, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt, unsigned int group_num, bitmap* into);
+
+// calls visit(index, record) for each live inode of the group in inode order
+void metadata_group_inodes(metadata_model* model, ext2_image* image, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt, unsigned int group_num, const std::function<void(uint32_t, const inode_record&)>& visit);
+
+// the record of any inode, read from its table if the model does not hold it, false if the number is out of range
+bool metadata_inode(metadata_model* model, ext2_image* image, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt, uint32_t inode_number, inode_record* record);
+
+// keeps the model in step after the pointers of a live inode were rewritten on the image
+void metadata_set_pointers(metadata_model* model, uint32_t inode_number, const uint32_t* pointers);
+
+#endif // METADATA_H
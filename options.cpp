@@ -0,0 +1,156 @@
+#include "options.h"
+
+#include <string.h>
+
+// value of "--name value" or "--name=value", NULL if argv[*i] is not --name
+static const char* option_value(int argc, char* argv[], int* i, const char* name) {
+    size_t name_length = strlen(name);
+    if (strncmp(argv[*i], name, name_length) != 0) {
+        return NULL;
+    }
+    if (argv[*i][name_length] == '=') {
+        return argv[*i] + name_length + 1;
+    }
+    if (argv[*i][name_length] == '\0' and *i + 1 < argc) {
+        (*i)++;
+        return argv[*i];
+    }
+    return NULL;
+}
+
+int parse_options(int argc, char* argv[], recext2fs_options* options) {
+    options->threads = 1;
+    options->block_recovery = BLOCK_RECOVERY_WALK;
+    options->repair_pointers = true;
+    options->use_map = true;
+    options->cache_size = 64UL << 20;
+    options->queue_depth = SCAN_DEFAULT_DEPTH;
+    options->scan_engine = SCAN_ENGINE_AUTO;
+    options->direct_io = false;
+    options->cache_stats = false;
+    options->identifiers.clear();
+    options->identifier_files.clear();
+    options->class_map = NULL;
+    options->dry_run = false;
+    options->overlay = NULL;
+    options->stats = NULL;
+    options->metadata_memory = 1024UL << 20;
+    options->tree_order = TREE_ORDER_DIRECTORY;
+
+    int kept = 1; // argv[0] stays
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--", 2) != 0) {
+            argv[kept++] = argv[i];
+            continue;
+        }
+
+        const char* value;
+        if ((value = option_value(argc, argv, &i, "--threads")) != NULL) {
+            int threads = atoi(value);
+            if (threads <= 0) {
+                printf("Error: invalid thread count %s\n", value);
+                return -1;
+            }
+            options->threads = threads;
+        }
+        else if ((value = option_value(argc, argv, &i, "--block-recovery")) != NULL) {
+            if (strcmp(value, "walk") == 0) {
+                options->block_recovery = BLOCK_RECOVERY_WALK;
+            }
+            else if (strcmp(value, "content") == 0) {
+                options->block_recovery = BLOCK_RECOVERY_CONTENT;
+            }
+            else {
+                printf("Error: unknown block recovery mode %s (walk or content)\n", value);
+                return -1;
+            }
+        }
+        else if ((value = option_value(argc, argv, &i, "--tree-order")) != NULL) {
+            if (strcmp(value, "inode") == 0) {
+                options->tree_order = TREE_ORDER_INODE;
+            }
+            else if (strcmp(value, "directory") == 0) {
+                options->tree_order = TREE_ORDER_DIRECTORY;
+            }
+            else {
+                printf("Error: unknown tree order %s (inode or directory)\n", value);
+                return -1;
+            }
+        }
+        else if ((value = option_value(argc, argv, &i, "--queue-depth")) != NULL) {
+            int depth = atoi(value);
+            if (depth <= 0) {
+                printf("Error: invalid queue depth %s\n", value);
+                return -1;
+            }
+            options->queue_depth = depth;
+        }
+        else if ((value = option_value(argc, argv, &i, "--io-engine")) != NULL) {
+            if (strcmp(value, "auto") == 0) {
+                options->scan_engine = SCAN_ENGINE_AUTO;
+            }
+            else if (strcmp(value, "uring") == 0) {
+                options->scan_engine = SCAN_ENGINE_URING;
+            }
+            else if (strcmp(value, "pread") == 0) {
+                options->scan_engine = SCAN_ENGINE_PREAD;
+            }
+            else {
+                printf("Error: unknown io engine %s (auto, uring or pread)\n", value);
+                return -1;
+            }
+        }
+        else if ((value = option_value(argc, argv, &i, "--identifiers")) != NULL) {
+            options->identifier_files.push_back(value);
+        }
+        else if ((value = option_value(argc, argv, &i, "--identifier")) != NULL) {
+            options->identifiers.push_back(value);
+        }
+        else if ((value = option_value(argc, argv, &i, "--class-map")) != NULL) {
+            options->class_map = value;
+        }
+        else if ((value = option_value(argc, argv, &i, "--overlay")) != NULL) {
+            options->overlay = value;
+        }
+        else if ((value = option_value(argc, argv, &i, "--stats")) != NULL) {
+            options->stats = value;
+        }
+        else if ((value = option_value(argc, argv, &i, "--cache-size")) != NULL) {
+            int megabytes = atoi(value);
+            if (megabytes <= 0) {
+                printf("Error: invalid cache size %s (MiB)\n", value);
+                return -1;
+            }
+            options->cache_size = (size_t)megabytes << 20;
+        }
+        else if ((value = option_value(argc, argv, &i, "--metadata-memory")) != NULL) {
+            int megabytes = atoi(value);
+            if (megabytes < 0 or (megabytes == 0 and strcmp(value, "0") != 0)) {
+                printf("Error: invalid metadata memory %s (MiB, 0 to disable)\n", value);
+                return -1;
+            }
+            options->metadata_memory = (size_t)megabytes << 20;
+        }
+        else if (strcmp(argv[i], "--no-pointer-repair") == 0) {
+            options->repair_pointers = false;
+        }
+        else if (strcmp(argv[i], "--no-mmap") == 0) {
+            options->use_map = false;
+        }
+        else if (strcmp(argv[i], "--cache-stats") == 0) {
+            options->cache_stats = true;
+        }
+        else if (strcmp(argv[i], "--direct-io") == 0) {
+            options->direct_io = true;
+        }
+        else if (strcmp(argv[i], "--dry-run") == 0) {
+            options->dry_run = true;
+        }
+        else {
+            printf("Error: unknown option %s\n", argv[i]);
+            return -1;
+        }
+    }
+    argv[kept] = NULL;
+    return kept;
+}
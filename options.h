@@ -0,0 +1,45 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <vector>
+
+#include "async_scan.h"
+
+enum block_recovery_mode {
+    BLOCK_RECOVERY_WALK, // walk the inode block trees, content scan only for groups the walk cannot account for
+    BLOCK_RECOVERY_CONTENT, // mark every non-zero block as used
+};
+
+enum tree_order_mode {
+    TREE_ORDER_INODE, // child inodes of a directory block are fetched sorted by their place in the inode tables, for cold or seeking storage
+    TREE_ORDER_DIRECTORY, // each child inode is fetched when its entry is printed, the default
+};
+
+struct recext2fs_options {
+    unsigned int threads; // worker threads for group recovery, 1 is the serial path
+    block_recovery_mode block_recovery;
+    bool repair_pointers; // reattach lost indirect pointers before the block bitmaps are rebuilt
+    bool use_map; // false forces the pread path
+    size_t cache_size; // block cache budget in bytes for the pread path
+    unsigned int queue_depth; // reads in flight for scans of an unmapped image
+    scan_engine_kind scan_engine;
+    bool direct_io; // scan block contents with O_DIRECT so they do not fill the page cache
+    bool cache_stats; // print block cache counters to stderr at exit
+    std::vector<const char*> identifiers; // --identifier "01 00 ...", on top of the positional one
+    std::vector<const char*> identifier_files; // --identifiers path, one identifier per line
+    const char* class_map; // classify every block and write the map here, NULL to skip
+    bool dry_run; // report the repaired blocks instead of writing them
+    const char* overlay; // leave the image untouched and keep the repairs in this sidecar, NULL to repair in place
+    const char* stats; // write the per-phase JSON report here, NULL to skip
+    size_t metadata_memory; // bytes the in-memory inode model may take, 0 reads the inode tables in every pass
+    tree_order_mode tree_order; // order the tree walk reads the inodes of subdirectories in, the output order is the same
+};
+
+// reads the --options out of argv and removes them
+// so argv[1] is the image and argv[2...] the identifier bytes afterwards
+// returns the new argc, or -1 on an invalid option
+int parse_options(int argc, char* argv[], recext2fs_options* options);
+
+#endif // OPTIONS_H
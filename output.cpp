@@ -0,0 +1,70 @@
+#include "output.h"
+#include "arena.h"
+
+#include <string.h>
+
+#define OUTPUT_INDENT_SIZE 256
+#define OUTPUT_BITMAP_BYTE_SIZE 17 // "\n" and 8 times "b "
+
+static char* output_buffer = NULL;
+static char indent_text[OUTPUT_INDENT_SIZE];
+static char bitmap_text[256][OUTPUT_BITMAP_BYTE_SIZE];
+
+void output_init() {
+    if (output_buffer != NULL) {
+        return;
+    }
+    output_buffer = (char*)counted_malloc(OUTPUT_BUFFER_SIZE);
+    if (output_buffer != NULL) {
+        setvbuf(stdout, output_buffer, _IOFBF, OUTPUT_BUFFER_SIZE);
+    }
+
+    memset(indent_text, '-', sizeof(indent_text));
+
+    // every byte value expanded once, a bitmap is then printed with one copy per byte
+    for (int value = 0; value < 256; value++) {
+        bitmap_text[value][0] = '\n';
+        for (int bit = 0; bit < 8; bit++) {
+            bitmap_text[value][1 + bit * 2] = '0' + ((value >> bit) & 1);
+            bitmap_text[value][2 + bit * 2] = ' ';
+        }
+    }
+}
+
+void output_flush() {
+    fflush(stdout);
+}
+
+void output_write(const char* data, size_t length) {
+    fwrite(data, 1, length, stdout);
+}
+
+void output_string(const char* text) {
+    fputs(text, stdout);
+}
+
+void output_indent(int depth) {
+    flockfile(stdout);
+    while (depth > 0) {
+        int length = depth < OUTPUT_INDENT_SIZE ? depth : OUTPUT_INDENT_SIZE;
+        fwrite_unlocked(indent_text, 1, length, stdout);
+        depth -= length;
+    }
+    putc_unlocked(' ', stdout);
+    funlockfile(stdout);
+}
+
+void output_bitmap(const uint8_t* bitmap, uint32_t bit_count) {
+    // lock once for the whole bitmap instead of once per call
+    flockfile(stdout);
+    uint32_t full_bytes = bit_count / 8;
+    for (uint32_t i = 0; i < full_bytes; i++) {
+        fwrite_unlocked(bitmap_text[bitmap[i]], 1, OUTPUT_BITMAP_BYTE_SIZE, stdout);
+    }
+    // the bits of a partial last byte are a prefix of its expansion
+    uint32_t rest = bit_count % 8;
+    if (rest != 0) {
+        fwrite_unlocked(bitmap_text[bitmap[full_bytes]], 1, 1 + rest * 2, stdout);
+    }
+    funlockfile(stdout);
+}
@@ -0,0 +1,28 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+// buffered stdout for the printers
+// stdout gets one large buffer so printf and the helpers below share it and keep their order,
+// the helpers copy precomputed text into it instead of formatting character by character
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+// call before anything is printed
+void output_init();
+
+void output_flush();
+
+void output_write(const char* data, size_t length);
+
+void output_string(const char* text);
+
+// depth dashes and a space, the prefix of a tree line
+void output_indent(int depth);
+
+// "\n" every 8 bits and "0 " or "1 " per bit, least significant bit of each byte first
+void output_bitmap(const uint8_t* bitmap, uint32_t bit_count);
+
+#endif // OUTPUT_H
@@ -0,0 +1,224 @@
+#include "overlay.h"
+#include "stats.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+
+dirty_set* overlay_load(const char* path, bool* missing, uint64_t* image_size) {
+    *missing = false;
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        *missing = errno == ENOENT;
+        if (!*missing) {
+            printf("Error: failed to open overlay %s\n", path);
+        }
+        return NULL;
+    }
+
+    overlay_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1 or memcmp(header.magic, OVERLAY_MAGIC, sizeof(header.magic)) != 0 or header.block_size == 0) {
+        printf("Error: %s is not an overlay\n", path);
+        fclose(file);
+        return NULL;
+    }
+
+    // the counts decide the allocations below, so they have to describe this file exactly
+    struct stat st;
+    uint64_t record_size = sizeof(uint64_t) + (uint64_t)header.block_size;
+    if (fstat(fileno(file), &st) != 0 or header.block_size > OVERLAY_MAX_BLOCK_SIZE
+        or header.block_count > ((uint64_t)st.st_size - sizeof(header)) / record_size
+        or sizeof(header) + header.block_count * record_size != (uint64_t)st.st_size) {
+        printf("Error: overlay %s is truncated or its header is damaged\n", path);
+        fclose(file);
+        return NULL;
+    }
+
+    std::vector<uint64_t> numbers(header.block_count);
+    if (fread(numbers.data(), sizeof(uint64_t), header.block_count, file) != header.block_count) {
+        printf("Error: overlay %s is truncated\n", path);
+        fclose(file);
+        return NULL;
+    }
+
+    dirty_set* set = dirty_set_create(header.block_size);
+    std::vector<uint8_t> block(header.block_size);
+    for (uint64_t i = 0; i < header.block_count; i++) {
+        if (fread(block.data(), 1, header.block_size, file) != header.block_size) {
+            printf("Error: overlay %s is truncated\n", path);
+            dirty_set_destroy(set);
+            fclose(file);
+            return NULL;
+        }
+        // whole blocks, nothing has to be loaded
+        dirty_set_write(set, numbers[i] * header.block_size, block.data(), header.block_size, NULL, NULL);
+    }
+    fclose(file);
+    *image_size = header.image_size;
+    return set;
+}
+
+bool overlay_save(const char* path, dirty_set* set, int fd, uint64_t image_size, bool dry_run, FILE* report) {
+    std::lock_guard<std::mutex> guard(set->lock);
+    std::vector<std::pair<uint64_t, uint8_t*>> pending;
+    uint64_t changed_total = dirty_set_pending(set, fd, &pending, dry_run ? report : NULL);
+    if (report != NULL) {
+        fprintf(report, "%s %lu blocks (%lu bytes changed) to overlay %s\n", dry_run ? "dry run, would write" : "wrote",
+            (unsigned long)pending.size(), (unsigned long)changed_total, path);
+    }
+    if (dry_run) {
+        return true;
+    }
+
+    // written next to the old overlay and renamed over it, so a failed save keeps the old one
+    std::string temporary = std::string(path) + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "w");
+    if (file == NULL) {
+        printf("Error: failed to create overlay %s\n", temporary.c_str());
+        return false;
+    }
+
+    overlay_header header;
+    memcpy(header.magic, OVERLAY_MAGIC, sizeof(header.magic));
+    header.block_size = set->block_size;
+    header.reserved = 0;
+    header.block_count = pending.size();
+    header.image_size = image_size;
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (size_t i = 0; ok and i < pending.size(); i++) {
+        ok = fwrite(&pending[i].first, sizeof(uint64_t), 1, file) == 1;
+    }
+    for (size_t i = 0; ok and i < pending.size(); i++) {
+        ok = fwrite(pending[i].second, 1, set->block_size, file) == set->block_size;
+    }
+    // stdio batches the writes, only the bytes are counted
+    stats_add(STATS_BYTES_WRITTEN, sizeof(header) + pending.size() * (sizeof(uint64_t) + set->block_size));
+    stats_add(STATS_SYNC_CALLS, 1);
+    ok = ok and fflush(file) == 0 and fsync(fileno(file)) == 0;
+    ok = fclose(file) == 0 and ok;
+    if (!ok or rename(temporary.c_str(), path) != 0) {
+        printf("Error: failed to write overlay %s\n", path);
+        unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+// plain read and write from the current offsets, for file systems copy_file_range does not work across
+static bool copy_rest(int source, int target, off_t left) {
+    std::vector<uint8_t> buffer(OVERLAY_COPY_BUFFER_SIZE);
+    while (left > 0) {
+        ssize_t got = read(source, buffer.data(), left < (off_t)buffer.size() ? left : buffer.size());
+        stats_add(STATS_READ_CALLS, 1);
+        if (got < 0 and errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        stats_add(STATS_BYTES_READ, got);
+        for (ssize_t done = 0; done < got;) {
+            ssize_t written = write(target, buffer.data() + done, got - done);
+            stats_add(STATS_WRITE_CALLS, 1);
+            if (written < 0 and errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                return false;
+            }
+            stats_add(STATS_BYTES_WRITTEN, written);
+            done += written;
+        }
+        left -= got;
+    }
+    return true;
+}
+
+// copies the whole image, holes stay holes where the kernel can manage it
+static bool copy_image(const char* from, const char* to) {
+    int source = open(from, O_RDONLY);
+    if (source < 0) {
+        printf("Error: failed to open image %s\n", from);
+        return false;
+    }
+    int target = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (target < 0) {
+        printf("Error: failed to create %s\n", to);
+        close(source);
+        return false;
+    }
+
+    struct stat st;
+    bool ok = fstat(source, &st) == 0;
+    off_t left = ok ? st.st_size : 0;
+    while (ok and left > 0) {
+        ssize_t copied = copy_file_range(source, NULL, target, NULL, left, 0);
+        stats_add(STATS_WRITE_CALLS, 1);
+        if (copied < 0 and (errno == EXDEV or errno == ENOSYS or errno == EINVAL or errno == EOPNOTSUPP)) {
+            // across file systems, old kernels or files that do not support it
+            ok = copy_rest(source, target, left);
+            break;
+        }
+        if (copied <= 0) {
+            ok = false;
+            break;
+        }
+        stats_add(STATS_BYTES_WRITTEN, copied);
+        left -= copied;
+    }
+    if (!ok) {
+        printf("Error: failed to copy %s to %s\n", from, to);
+    }
+    close(source);
+    close(target);
+    return ok;
+}
+
+bool overlay_apply(const char* path, const char* image_path, const char* output_path) {
+    bool missing;
+    uint64_t image_size;
+    dirty_set* set = overlay_load(path, &missing, &image_size);
+    if (set == NULL) {
+        if (missing) {
+            printf("Error: overlay %s does not exist\n", path);
+        }
+        return false;
+    }
+
+    // checked on the source, a mismatch is found before anything is copied
+    struct stat st;
+    if (stat(image_path, &st) != 0) {
+        printf("Error: failed to open image %s\n", image_path);
+        dirty_set_destroy(set);
+        return false;
+    }
+    if ((uint64_t)st.st_size != image_size) {
+        printf("Error: overlay %s was made for an image of %lu bytes, %s has %lu\n", path, (unsigned long)image_size, image_path, (unsigned long)st.st_size);
+        dirty_set_destroy(set);
+        return false;
+    }
+
+    const char* target_path = image_path;
+    if (output_path != NULL) {
+        if (!copy_image(image_path, output_path)) {
+            dirty_set_destroy(set);
+            return false;
+        }
+        target_path = output_path;
+    }
+
+    int fd = open(target_path, O_RDWR);
+    if (fd < 0) {
+        printf("Error: failed to open image %s\n", target_path);
+        dirty_set_destroy(set);
+        return false;
+    }
+    bool ok = dirty_set_flush(set, fd, false, NULL);
+    close(fd);
+    dirty_set_destroy(set);
+    return ok;
+}
@@ -0,0 +1,36 @@
+#ifndef OVERLAY_H
+#define OVERLAY_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "dirty_set.h"
+
+// copy-on-write sidecar for a read-only image
+// the repaired blocks are stored next to the image instead of in it:
+//   overlay_header, block_count block numbers (uint64_t, ascending), block_count blocks of data
+#define OVERLAY_MAGIC "EXT2OVL1"
+#define OVERLAY_MAX_BLOCK_SIZE (64 << 10) // largest ext2 block size
+#define OVERLAY_COPY_BUFFER_SIZE (1 << 20) // chunk of the read/write copy when copy_file_range cannot be used
+
+struct overlay_header {
+    char magic[8];
+    uint32_t block_size;
+    uint32_t reserved;
+    uint64_t block_count;
+    uint64_t image_size; // size of the image the overlay was made for
+};
+
+// reads an overlay into a new dirty set, NULL if it does not exist or is invalid
+// missing is set when the file does not exist, which is not an error for a first run
+dirty_set* overlay_load(const char* path, bool* missing, uint64_t* image_size);
+
+// writes the staged blocks that differ from the image (fd) to the overlay at path
+// the file is replaced as a whole, with dry_run only the report is made
+bool overlay_save(const char* path, dirty_set* set, int fd, uint64_t image_size, bool dry_run, FILE* report);
+
+// writes the overlay into the image, or into output if it is not NULL (a copy of the image is made first)
+bool overlay_apply(const char* path, const char* image_path, const char* output_path);
+
+#endif // OVERLAY_H
@@ -0,0 +1,407 @@
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <vector>
+#include <algorithm>
+
+#include "pointer_repair.h"
+#include "reachability.h"
+#include "block_map.h"
+#include "thread_pool.h"
+#include "block_class.h"
+#include "arena.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define POINTER_REPAIR_X86
+#endif
+
+// blocks classified per task of the candidate pass
+#define CLASSIFY_RANGE_BLOCKS 4096
+
+typedef bool (*pointer_kernel)(const uint32_t* words, uint32_t word_count, uint32_t low, uint32_t high, uint32_t* count);
+
+static bool is_pointer_block_scalar(const uint32_t* words, uint32_t word_count, uint32_t low, uint32_t high, uint32_t* count) {
+    uint32_t i = 0;
+    while (i < word_count and words[i] != 0) {
+        if (words[i] < low or words[i] >= high) {
+            return false;
+        }
+        i++;
+    }
+    *count = i;
+    for (; i < word_count; i++) {
+        if (words[i] != 0) {
+            return false;
+        }
+    }
+    return *count > 0;
+}
+
+#ifdef POINTER_REPAIR_X86
+__attribute__((target("avx2")))
+static bool is_pointer_block_avx2(const uint32_t* words, uint32_t word_count, uint32_t low, uint32_t high, uint32_t* count) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i low_vector = _mm256_set1_epi32(low);
+    const __m256i last_vector = _mm256_set1_epi32(high - 1);
+    uint32_t non_zero = 0; // non-zero words seen so far
+    bool in_prefix = true; // no zero word seen yet
+    uint32_t i = 0;
+    for (; i + 8 <= word_count; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(words + i));
+        __m256i is_zero = _mm256_cmpeq_epi32(v, zero);
+        // unsigned low <= v <= high - 1 through min/max
+        __m256i above_low = _mm256_cmpeq_epi32(_mm256_max_epu32(v, low_vector), v);
+        __m256i below_high = _mm256_cmpeq_epi32(_mm256_min_epu32(v, last_vector), v);
+        __m256i valid = _mm256_or_si256(is_zero, _mm256_and_si256(above_low, below_high));
+        if (_mm256_movemask_ps(_mm256_castsi256_ps(valid)) != 0xff) {
+            return false;
+        }
+        unsigned int set = ~_mm256_movemask_ps(_mm256_castsi256_ps(is_zero)) & 0xff;
+        if (!in_prefix) {
+            if (set != 0) {
+                return false;
+            }
+            continue;
+        }
+        // the non-zero lanes have to be the low lanes 0 ... k-1
+        if ((set & (set + 1)) != 0) {
+            return false;
+        }
+        non_zero += __builtin_popcount(set);
+        if (set != 0xff) {
+            in_prefix = false;
+        }
+    }
+    for (; i < word_count; i++) {
+        if (words[i] == 0) {
+            in_prefix = false;
+        }
+        else if (!in_prefix or words[i] < low or words[i] >= high) {
+            return false;
+        }
+        else {
+            non_zero++;
+        }
+    }
+    *count = non_zero;
+    return non_zero > 0;
+}
+#endif
+
+static pointer_kernel pick_pointer_kernel() {
+#ifdef POINTER_REPAIR_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return is_pointer_block_avx2;
+    }
+#endif
+    return is_pointer_block_scalar;
+}
+
+bool is_pointer_block(const uint32_t* words, uint32_t word_count, uint32_t low, uint32_t high, uint32_t* count) {
+    static const pointer_kernel kernel = pick_pointer_kernel();
+    return kernel(words, word_count, low, high, count);
+}
+
+struct repair_candidate {
+    uint32_t block;
+    uint32_t count; // pointer blocks: length of the non-zero prefix, 0 for directory blocks
+    uint32_t dir_inode; // directory blocks: inode of the "." entry
+    bool claimed;
+};
+
+struct repair_context {
+    ext2_image* image;
+    ext2_super_block* super_block;
+    const bitmap* owned; // filesystem wide bitmap of reachable blocks
+    std::vector<repair_candidate> candidates; // sorted by block
+    std::vector<std::vector<uint32_t>> by_count; // pointer candidates by prefix length, indexes in block order
+    std::vector<uint32_t> by_dir_inode; // directory candidates sorted by "." inode, then block
+    uint64_t per_block;
+    arena scratch; // child lists of the subtree checks, rolled back when a check returns
+};
+
+static bool is_owned(repair_context* context, uint32_t block) {
+    return bitmap_test(context->owned, block - context->super_block->first_data_block);
+}
+
+static repair_candidate* find_candidate(repair_context* context, uint32_t block) {
+    auto found = std::lower_bound(context->candidates.begin(), context->candidates.end(), block,
+        [](const repair_candidate& candidate, uint32_t value) { return candidate.block < value; });
+    if (found == context->candidates.end() or found->block != block) {
+        return NULL;
+    }
+    return &*found;
+}
+
+// the single classification pass over [first, first + count)
+static void classify_range(repair_context* context, uint32_t first, uint32_t count, const signature_index* index, std::vector<repair_candidate>* found) {
+    uint32_t block_size = context->image->block_size;
+    uint32_t* scratch = (uint32_t*)thread_buffer_get(block_size);
+    for (uint32_t block = first; block < first + count; block++) {
+        if (is_owned(context, block)) {
+            continue;
+        }
+        const uint8_t* data = image_block(context->image, block, scratch);
+        uint32_t detail;
+        block_class kind = classify_block(data, block_size, context->super_block, index, &detail);
+
+        // the first block of a directory names its inode in the "." entry
+        if (kind == BLOCK_DIRECTORY and detail != 0) {
+            found->push_back({ block, 0, detail, false });
+            continue;
+        }
+        if (kind != BLOCK_POINTER) {
+            continue;
+        }
+        // a lost pointer block only points at blocks nobody else owns
+        const uint32_t* words = (const uint32_t*)data;
+        bool plausible = true;
+        for (uint32_t i = 0; i < detail and plausible; i++) {
+            plausible = !is_owned(context, words[i]);
+        }
+        if (plausible) {
+            found->push_back({ block, detail, 0, false });
+        }
+    }
+    thread_buffer_put((uint8_t*)scratch, block_size);
+}
+
+// true if block is an unclaimed pointer block of the given level (1 = points at data)
+// whose subtree covers exactly data_blocks file blocks
+static bool subtree_matches(repair_context* context, uint32_t block, int level, uint64_t data_blocks) {
+    repair_candidate* candidate = find_candidate(context, block);
+    if (candidate == NULL or candidate->claimed or candidate->count == 0) {
+        return false;
+    }
+    uint64_t child_span = 1;
+    for (int i = 1; i < level; i++) {
+        child_span *= context->per_block;
+    }
+    if (candidate->count != (data_blocks + child_span - 1) / child_span) {
+        return false;
+    }
+    if (level == 1) {
+        return true;
+    }
+
+    // the children are copied out since the checks below may evict the block from the cache
+    arena_mark mark = arena_save(&context->scratch);
+    uint32_t* children = (uint32_t*)arena_alloc(&context->scratch, context->image->block_size);
+    const uint32_t* words = (const uint32_t*)image_block(context->image, block, children);
+    uint32_t* copy = (uint32_t*)arena_alloc(&context->scratch, candidate->count * sizeof(uint32_t));
+    memcpy(copy, words, candidate->count * sizeof(uint32_t));
+    bool matches = true;
+    for (uint32_t i = 0; i < candidate->count and matches; i++) {
+        uint64_t below = data_blocks - i * child_span < child_span ? data_blocks - i * child_span : child_span;
+        matches = subtree_matches(context, copy[i], level - 1, below);
+    }
+    arena_restore(&context->scratch, mark);
+    return matches;
+}
+
+static void claim_subtree(repair_context* context, uint32_t block, int level) {
+    repair_candidate* candidate = find_candidate(context, block);
+    if (candidate == NULL) {
+        return;
+    }
+    candidate->claimed = true;
+    if (level == 1) {
+        return;
+    }
+    arena_mark mark = arena_save(&context->scratch);
+    uint32_t* children = (uint32_t*)arena_alloc(&context->scratch, context->image->block_size);
+    const uint32_t* words = (const uint32_t*)image_block(context->image, block, children);
+    uint32_t* copy = (uint32_t*)arena_alloc(&context->scratch, candidate->count * sizeof(uint32_t));
+    memcpy(copy, words, candidate->count * sizeof(uint32_t));
+    for (uint32_t i = 0; i < candidate->count; i++) {
+        claim_subtree(context, copy[i], level - 1);
+    }
+    arena_restore(&context->scratch, mark);
+}
+
+// closest unclaimed pointer block to anchor whose subtree fits, 0 if there is none
+// only candidates with the pointer count the subtree needs are looked at, outwards from the anchor,
+// so the first one that fits is the closest (the lower block on a tie)
+static uint32_t find_pointer_tree(repair_context* context, int level, uint64_t data_blocks, uint32_t anchor) {
+    uint64_t child_span = 1;
+    for (int i = 1; i < level; i++) {
+        child_span *= context->per_block;
+    }
+    uint64_t count = (data_blocks + child_span - 1) / child_span;
+    if (count >= context->by_count.size()) {
+        return 0;
+    }
+    const std::vector<uint32_t>& bucket = context->by_count[count];
+    const std::vector<repair_candidate>& candidates = context->candidates;
+    size_t above = std::lower_bound(bucket.begin(), bucket.end(), anchor,
+        [&](uint32_t index, uint32_t value) { return candidates[index].block < value; }) - bucket.begin();
+    size_t below = above; // bucket[below - 1] is the next one under the anchor
+    uint32_t best = 0;
+    while (best == 0 and (below > 0 or above < bucket.size())) {
+        bool take_below = below > 0 and (above == bucket.size()
+            or anchor - candidates[bucket[below - 1]].block <= candidates[bucket[above]].block - anchor);
+        const repair_candidate& candidate = candidates[take_below ? bucket[--below] : bucket[above++]];
+        if (!candidate.claimed and subtree_matches(context, candidate.block, level, data_blocks)) {
+            best = candidate.block;
+        }
+    }
+    if (best != 0) {
+        claim_subtree(context, best, level);
+    }
+    return best;
+}
+
+static uint32_t find_directory_block(repair_context* context, uint32_t inode_number) {
+    const std::vector<repair_candidate>& candidates = context->candidates;
+    auto found = std::lower_bound(context->by_dir_inode.begin(), context->by_dir_inode.end(), inode_number,
+        [&](uint32_t index, uint32_t value) { return candidates[index].dir_inode < value; });
+    for (; found != context->by_dir_inode.end() and candidates[*found].dir_inode == inode_number; found++) {
+        repair_candidate& candidate = context->candidates[*found];
+        if (!candidate.claimed) {
+            candidate.claimed = true;
+            return candidate.block;
+        }
+    }
+    return 0;
+}
+
+// fills the missing pointers of one inode, returns how many were restored
+static uint32_t repair_inode(repair_context* context, uint32_t inode_number, inode_record* inode) {
+    uint32_t block_size = context->image->block_size;
+    uint64_t per_block = context->per_block;
+    uint64_t file_blocks = (inode->size + block_size - 1) / block_size;
+    uint32_t restored = 0;
+
+    // the first block of a directory names itself in its "." entry
+    if ((inode->mode & 0xf000) == EXT2_I_DTYPE and file_blocks > 0 and inode->pointers[0] == 0) {
+        inode->pointers[0] = find_directory_block(context, inode_number);
+        restored += inode->pointers[0] != 0;
+    }
+
+    // anchor the search at the highest block the inode still knows about
+    uint32_t anchor = 0;
+    for (int i = 0; i < EXT2_NUM_DIRECT_BLOCKS; i++) {
+        anchor = std::max(anchor, inode->pointers[i]);
+    }
+
+    uint32_t* indirect = inode->pointers + EXT2_NUM_DIRECT_BLOCKS;
+    uint64_t remaining = file_blocks > EXT2_NUM_DIRECT_BLOCKS ? file_blocks - EXT2_NUM_DIRECT_BLOCKS : 0;
+    uint64_t span = per_block;
+    for (int level = 1; level <= BLOCK_MAP_LEVELS and remaining > 0; level++) {
+        uint64_t covered = remaining < span ? remaining : span;
+        if (indirect[level - 1] == 0) {
+            indirect[level - 1] = find_pointer_tree(context, level, covered, anchor);
+            restored += indirect[level - 1] != 0;
+        }
+        anchor = std::max(anchor, indirect[level - 1]);
+        remaining -= covered;
+        span *= per_block;
+    }
+    return restored;
+}
+
+// number of blocks the iterator reaches from the inode's current pointers
+static uint64_t reachable_block_count(ext2_image* image, const inode_record* inode) {
+    block_map_iterator iterator;
+    block_map_entry entry;
+    uint64_t count = 0;
+    block_map_open_pointers(&iterator, image, inode->pointers, inode->size, inode->block_count_512);
+    while (block_map_next(&iterator, &entry)) {
+        count++;
+    }
+    block_map_close(&iterator);
+    return count;
+}
+
+void repair_inode_pointers(metadata_model* model, ext2_image* image, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt, unsigned int group_count, unsigned int thread_count, const signature_index* index, pointer_repair_stats* stats) {
+    stats->candidates = 0;
+    stats->inodes_repaired = 0;
+    stats->pointers_restored = 0;
+
+    repair_context context;
+    context.image = image;
+    context.super_block = super_block;
+    context.per_block = image->block_size / sizeof(uint32_t);
+    arena_init(&context.scratch, 8 * image->block_size); // enough for the three levels of a triple indirect tree
+
+    // everything the current pointers and group metadata already account for
+    bitmap owned;
+    bitmap_init(&owned, reachability_bit_count(super_block, group_count));
+    mark_metadata_blocks(super_block, bgdt, group_count, &owned);
+    mark_reachable_blocks(model, image, super_block, bgdt, group_count, thread_count, &owned);
+    context.owned = &owned;
+
+    // one parallel classification pass over the unreached blocks
+    uint32_t first_block = super_block->first_data_block;
+    uint32_t block_count = super_block->block_count;
+    size_t range_count = ((uint64_t)block_count - first_block + CLASSIFY_RANGE_BLOCKS - 1) / CLASSIFY_RANGE_BLOCKS;
+    std::vector<std::vector<repair_candidate>> found(range_count);
+    run_parallel(thread_count, range_count, [&](size_t i) {
+        uint32_t first = first_block + i * CLASSIFY_RANGE_BLOCKS;
+        uint32_t count = block_count - first < CLASSIFY_RANGE_BLOCKS ? block_count - first : CLASSIFY_RANGE_BLOCKS;
+        classify_range(&context, first, count, index, &found[i]);
+    });
+    for (auto& range : found) { // ranges are in block order so the result stays sorted
+        context.candidates.insert(context.candidates.end(), range.begin(), range.end());
+    }
+    stats->candidates = context.candidates.size();
+    if (context.candidates.empty()) {
+        bitmap_free(&owned);
+        arena_free(&context.scratch);
+        return;
+    }
+
+    // lookup tables, each damaged inode then only looks at the candidates that can fit it
+    context.by_count.resize(context.per_block + 1);
+    std::vector<uint32_t> bucket_size(context.per_block + 1, 0);
+    for (const repair_candidate& candidate : context.candidates) {
+        bucket_size[candidate.count]++;
+    }
+    for (uint32_t count = 1; count <= context.per_block; count++) {
+        context.by_count[count].reserve(bucket_size[count]);
+    }
+    context.by_dir_inode.reserve(bucket_size[0]);
+    for (uint32_t i = 0; i < context.candidates.size(); i++) {
+        const repair_candidate& candidate = context.candidates[i];
+        if (candidate.count != 0) {
+            context.by_count[candidate.count].push_back(i);
+        }
+        else {
+            context.by_dir_inode.push_back(i);
+        }
+    }
+    std::sort(context.by_dir_inode.begin(), context.by_dir_inode.end(), [&](uint32_t a, uint32_t b) {
+        // indexes follow the block order
+        return context.candidates[a].dir_inode != context.candidates[b].dir_inode ? context.candidates[a].dir_inode < context.candidates[b].dir_inode : a < b;
+    });
+
+    // inodes that own fewer blocks than they were allocated
+    uint32_t blocks_512 = image->block_size / 512;
+    for (unsigned int group_num = 0; group_num < group_count; group_num++) {
+        std::vector<std::pair<uint32_t, inode_record>> damaged;
+        metadata_group_inodes(model, image, super_block, bgdt, group_num, [&](uint32_t index, const inode_record& inode) {
+            if (inode.block_count_512 != 0 and reachable_block_count(image, &inode) < inode.block_count_512 / blocks_512) {
+                damaged.push_back({ index, inode });
+            }
+        });
+
+        for (auto& entry : damaged) {
+            uint32_t inode_number = group_num * super_block->inodes_per_group + entry.first + 1;
+            uint32_t restored = repair_inode(&context, inode_number, &entry.second);
+            if (restored == 0) {
+                continue;
+            }
+            // only the pointer fields are written back
+            uint64_t offset = (uint64_t)bgdt[group_num].inode_table * image->block_size + (uint64_t)entry.first * super_block->inode_size;
+            offset += offsetof(ext2_inode, direct_blocks);
+            image_write(image, offset, entry.second.pointers, sizeof(entry.second.pointers));
+            metadata_set_pointers(model, inode_number, entry.second.pointers);
+            stats->inodes_repaired++;
+            stats->pointers_restored += restored;
+        }
+    }
+    bitmap_free(&owned);
+    arena_free(&context.scratch);
+}
@@ -0,0 +1,33 @@
+#ifndef POINTER_REPAIR_H
+#define POINTER_REPAIR_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "ext2fs.h"
+#include "image.h"
+#include "identifier.h"
+#include "metadata.h"
+
+// reattaches blocks to inodes whose pointers were wiped
+//
+// every block the metadata walk does not reach is classified once, in parallel, with
+// classify_block: a pointer block must also point only at other unreached blocks, a directory
+// block is used when it starts with a "." entry naming its own inode. inodes that own fewer blocks than block_count_512 says then get
+// their missing single, double or triple indirect pointer (and a directory its first block)
+// back from the candidates whose subtree has exactly the shape the file size asks for
+
+struct pointer_repair_stats {
+    uint32_t candidates; // unreached blocks that look like pointer or directory blocks
+    uint32_t inodes_repaired;
+    uint32_t pointers_restored;
+};
+
+// inodes come from model, or from the inode tables if it is NULL, repaired pointers are written to both
+void repair_inode_pointers(metadata_model* model, ext2_image* image, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt, unsigned int group_count, unsigned int thread_count, const signature_index* index, pointer_repair_stats* stats);
+
+// true if the block looks like a pointer block: every word is 0 or in [low, high)
+// and the non-zero words form a prefix of at least one entry, count is set to its length
+bool is_pointer_block(const uint32_t* words, uint32_t word_count, uint32_t low, uint32_t high, uint32_t* count);
+
+#endif // POINTER_REPAIR_H
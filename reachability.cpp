@@ -0,0 +1,95 @@
+#include "reachability.h"
+#include "metadata.h"
+#include "thread_pool.h"
+#include "block_map.h"
+
+uint64_t reachability_bit_count(ext2_super_block* super_block, unsigned int group_count) {
+    return (uint64_t)group_count * super_block->blocks_per_group;
+}
+
+// false for pointers outside the filesystem, those are not followed
+// bitmap words are shared between worker threads
+static inline bool mark_block(ext2_super_block* super_block, bitmap* map, uint32_t block) {
+    if (block < super_block->first_data_block or block >= super_block->block_count) {
+        return false;
+    }
+    bitmap_set_atomic(map, block - super_block->first_data_block);
+    return true;
+}
+
+static bool is_power_of(unsigned int n, unsigned int base) {
+    while (n > 1 and n % base == 0) {
+        n /= base;
+    }
+    return n == 1;
+}
+
+bool group_has_super_block(ext2_super_block* super_block, unsigned int group_num) {
+    if (!(super_block->feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER)) {
+        return true;
+    }
+    return group_num <= 1 or is_power_of(group_num, 3) or is_power_of(group_num, 5) or is_power_of(group_num, 7);
+}
+
+uint32_t group_block_count(ext2_super_block* super_block, unsigned int group_num) {
+    uint64_t first = (uint64_t)group_num * super_block->blocks_per_group + super_block->first_data_block;
+    if (first >= super_block->block_count) {
+        return 0;
+    }
+    uint64_t count = super_block->block_count - first;
+    return count < super_block->blocks_per_group ? count : super_block->blocks_per_group;
+}
+
+uint32_t group_marked_blocks(ext2_super_block* super_block, const bitmap* map, unsigned int group_num) {
+    return bitmap_count(map, (uint64_t)group_num * super_block->blocks_per_group, group_block_count(super_block, group_num));
+}
+
+void mark_metadata_blocks(ext2_super_block* super_block, ext2_block_group_descriptor* bgdt, unsigned int group_count, bitmap* map) {
+    uint32_t block_size = EXT2_UNLOG(super_block->log_block_size);
+    uint32_t bgdt_blocks = ((uint64_t)group_count * sizeof(ext2_block_group_descriptor) + block_size - 1) / block_size;
+    uint32_t inode_table_blocks = ((uint64_t)super_block->inodes_per_group * super_block->inode_size + block_size - 1) / block_size;
+
+    for (unsigned int i = 0; i < group_count; i++) {
+        uint32_t group_first = super_block->first_data_block + i * super_block->blocks_per_group;
+        if (group_has_super_block(super_block, i)) {
+            // super block, BGDT and the reserved BGDT blocks
+            for (uint32_t j = 0; j < 1 + bgdt_blocks + super_block->reserved_gdt_blocks; j++) {
+                mark_block(super_block, map, group_first + j);
+            }
+        }
+        mark_block(super_block, map, bgdt[i].block_bitmap);
+        mark_block(super_block, map, bgdt[i].inode_bitmap);
+        for (uint32_t j = 0; j < inode_table_blocks; j++) {
+            mark_block(super_block, map, bgdt[i].inode_table + j);
+        }
+    }
+
+    // blocks past the end of the filesystem are marked used in the last group
+    uint64_t last_bit = (uint64_t)group_count * super_block->blocks_per_group;
+    uint64_t end = super_block->block_count - super_block->first_data_block;
+    if (end < last_bit) {
+        bitmap_set_range(map, end, last_bit - end);
+    }
+}
+
+static void mark_group_inodes(metadata_model* model, ext2_image* image, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt, unsigned int group_num, bitmap* map) {
+    metadata_group_inodes(model, image, super_block, bgdt, group_num, [&](uint32_t, const inode_record& inode) {
+        // no blocks at all, this also skips fast symlinks which keep their target in the pointer fields
+        if (inode.block_count_512 == 0) {
+            return;
+        }
+        block_map_iterator iterator;
+        block_map_entry entry;
+        block_map_open_pointers(&iterator, image, inode.pointers, inode.size, inode.block_count_512);
+        while (block_map_next(&iterator, &entry)) {
+            mark_block(super_block, map, entry.physical);
+        }
+        block_map_close(&iterator);
+    });
+}
+
+void mark_reachable_blocks(metadata_model* model, ext2_image* image, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt, unsigned int group_count, unsigned int thread_count, bitmap* map) {
+    run_parallel(thread_count, group_count, [&](size_t i) {
+        mark_group_inodes(model, image, super_block, bgdt, i, map);
+    });
+}
@@ -0,0 +1,36 @@
+#ifndef REACHABILITY_H
+#define REACHABILITY_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "ext2fs.h"
+#include "image.h"
+#include "bitmap.h"
+#include "metadata.h"
+
+// block usage rebuilt from metadata alone
+// the bitmap covers the whole filesystem, bit (block - first_data_block) is block
+// so group g starts at bit g * blocks_per_group
+
+// bits of the filesystem wide bitmap
+uint64_t reachability_bit_count(ext2_super_block* super_block, unsigned int group_count);
+
+// super block and BGDT copies, bitmaps and inode tables of every group,
+// and the bits past the last block of the last group
+void mark_metadata_blocks(ext2_super_block* super_block, ext2_block_group_descriptor* bgdt, unsigned int group_count, bitmap* map);
+
+// walks the direct, single, double and triple indirect trees of every live inode
+// and marks the data and pointer blocks, groups of inodes are walked on thread_count threads
+// the inodes come from model, or from the inode tables if it is NULL
+void mark_reachable_blocks(metadata_model* model, ext2_image* image, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt, unsigned int group_count, unsigned int thread_count, bitmap* map);
+
+// number of blocks that exist in the group (the last group can have fewer)
+uint32_t group_block_count(ext2_super_block* super_block, unsigned int group_num);
+
+// set bits of the group inside the filesystem wide bitmap
+uint32_t group_marked_blocks(ext2_super_block* super_block, const bitmap* map, unsigned int group_num);
+
+bool group_has_super_block(ext2_super_block* super_block, unsigned int group_num);
+
+#endif // REACHABILITY_H
@@ -2,41 +2,85 @@
 #include <stdlib.h>
 #include <string.h>
 #include <vector>
+#include <deque>
+#include <algorithm>
 
 #include "identifier.h"
 #include "ext2fs_print.h"
 #include "ext2fs.h"
 #include "bitmap_prints.h"
+#include "image.h"
+#include "inode_table.h"
+#include "options.h"
+#include "thread_pool.h"
+#include "zero_scan.h"
+#include "reachability.h"
+#include "block_map.h"
+#include "block_cache.h"
+#include "pointer_repair.h"
+#include "block_class.h"
+#include "output.h"
+#include "overlay.h"
+#include "stats.h"
+#include "bitmap.h"
+#include "bitmap_diff.h"
+#include "metadata.h"
+#include "inode_scan.h"
+#include "dir_block.h"
 
 // GLOBALS
 uint8_t* identifier;
+size_t identifier_length;
+signature_index signatures; // the positional identifier first, then the ones given with options
 uint32_t block_size;
 unsigned int group_count;
+recext2fs_options options;
+metadata_model* metadata; // NULL when the passes read the inode tables themselves
 
-void print_all_directories(FILE* file, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt, ext2_inode* inode, int depth);
 
-
-ext2_super_block* read_super_block(FILE* file, uint8_t* identifier) {
+ext2_super_block* read_super_block(ext2_image* image, uint8_t* identifier) {
     ext2_super_block* super_block = new ext2_super_block;
     if (super_block == NULL) {
         printf("Error: failed to allocate memory for super block\n");
         return NULL;
     }
 
-    fseek(file, EXT2_SUPER_BLOCK_POSITION, SEEK_SET);
-    fread(super_block, sizeof(ext2_super_block), 1, file);
+    if (!image_read(image, EXT2_SUPER_BLOCK_POSITION, super_block, sizeof(ext2_super_block))) {
+        printf("Error: failed to read super block\n");
+        delete super_block;
+        return NULL;
+    }
 
     return super_block;
 }
 
-ext2_block_group_descriptor* read_block_group_descriptor_table(FILE* file, ext2_super_block* super_block) {
+// the table starts in the block after the super block, block 2 with 1 KiB blocks and block 1 otherwise
+uint64_t block_group_descriptor_table_offset(ext2_super_block* super_block) {
+    return ((uint64_t)super_block->first_data_block + 1) * block_size;
+}
+
+// bytes a bitmap of bit_count bits takes on disk, whole blocks
+uint32_t bitmap_size(uint32_t bit_count) {
+    uint32_t bytes = (bit_count + 7) / 8;
+    return (bytes + block_size - 1) / block_size * block_size;
+}
+
+// sets bits [first_bit, size * 8), the padding after the last real bit is always 1 on disk
+void set_padding_bits(bitmap* map, uint32_t first_bit, uint32_t size) {
+    bitmap_set_range(map, first_bit, (uint64_t)size * 8 - first_bit);
+}
+
+ext2_block_group_descriptor* read_block_group_descriptor_table(ext2_image* image, ext2_super_block* super_block) {
     ext2_block_group_descriptor* bgdt = new ext2_block_group_descriptor[group_count];
     if (bgdt == NULL) {
         printf("Error: failed to allocate memory for block group descriptor table\n");
         return NULL;
     }
-    fseek(file, EXT2_SUPER_BLOCK_POSITION + EXT2_SUPER_BLOCK_SIZE, SEEK_SET);
-    fread(bgdt, sizeof(ext2_block_group_descriptor), group_count, file);
+    if (!image_read(image, block_group_descriptor_table_offset(super_block), bgdt, sizeof(ext2_block_group_descriptor) * group_count)) {
+        printf("Error: failed to read block group descriptor table\n");
+        delete[] bgdt;
+        return NULL;
+    }
 
     return bgdt;
 }
@@ -51,208 +95,234 @@ void print_block_group_descriptor_table(ext2_block_group_descriptor* bgdt, unsig
 
 
 
-ext2_inode* read_inode(FILE* file, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt, unsigned int inode_number) {
-    ext2_inode* inode = new ext2_inode;
-    if (inode == NULL) {
-        printf("Error: failed to allocate memory for inode\n");
+// fills record from the metadata model (or the inode table) and returns it, NULL if there is no such inode
+const inode_record* read_inode(ext2_image* image, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt, unsigned int inode_number, inode_record* record) {
+    if (!metadata_inode(metadata, image, super_block, bgdt, inode_number, record)) {
         return NULL;
     }
-
-    unsigned int group_number = (inode_number - 1) / super_block->inodes_per_group;
-    unsigned int inode_index = (inode_number - 1) % super_block->inodes_per_group;
-    unsigned int inode_table_block = bgdt[group_number].inode_table;
-    unsigned int inode_offset = inode_index * super_block->inode_size;
-    
-    fseek(file, block_size * inode_table_block + inode_offset, SEEK_SET);
-    fread(inode, sizeof(ext2_inode), 1, file);
-
-    return inode;
+    return record;
 }
 
 void print_indent(int depth) {
-    for (int i = 0; i < depth; i++) {
-        printf("-");
-    }
-    printf(" ");
+    output_indent(depth);
 }
 
-void process_directory_entry(FILE* file, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt, ext2_dir_entry* dir_entry, int depth) {
-    std::vector<char> name(dir_entry->name_length + 1);
-    fread(name.data(), dir_entry->name_length, 1, file);
-    name[dir_entry->name_length] = '\0';
-
-    if (strcmp(name.data(), ".") != 0 and strcmp(name.data(), "..") != 0) { // ignore . and ..
-        print_indent(depth);
-        if (dir_entry->file_type == EXT2_D_DTYPE) { // directory
-            printf("%s/\n", name.data());
-            ext2_inode* inode = read_inode(file, super_block, bgdt, dir_entry->inode); 
-            print_all_directories(file, super_block, bgdt, inode, depth + 1);
-            free(inode);
-        } else { // file
-            printf("%s\n", name.data());
-        }
-    }
+// a subdirectory entry whose inode was fetched ahead of printing
+struct directory_child {
+    uint32_t inode;
+    uint64_t table_offset; // byte offset of the inode, the fetch order
+    bool found; // false if the number is out of range
+    bool visited; // listed before the block was read, not fetched
+    inode_record record;
+};
+
+// one directory being listed, the walk keeps a stack of these instead of recursing
+struct directory_frame {
+    block_map_iterator blocks; // the directory's data blocks
+    std::vector<uint8_t> scratch; // block buffer for unmapped images, kept when the frame is reused
+    dir_block_reader entries; // records of the current directory block
+    uint32_t block; // physical number of that block
+    std::vector<directory_child> children; // subdirectories of the current block in entry order, TREE_ORDER_INODE only
+    size_t next_child; // the one the next printed subdirectory entry takes
+    std::vector<uint32_t> fetch_order; // indexes into children, kept to reuse its memory
+    int depth;
+};
+
+void directory_frame_open(ext2_image* image, directory_frame* frame, const inode_record* inode, int depth) {
+    block_map_open_pointers(&frame->blocks, image, inode->pointers, inode->size, inode->block_count_512);
+    frame->scratch.resize(block_size);
+    dir_block_open(&frame->entries, NULL, 0); // no block yet
+    frame->children.clear();
+    frame->next_child = 0;
+    frame->depth = depth;
 }
 
-void read_block_entries(FILE* file, unsigned int block_number, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt, int depth) {
-    ext2_dir_entry* dir_entry = new ext2_dir_entry;
-    unsigned int offset = 0;
+// true for the entries the walk descends into, the same test for fetching and printing
+bool is_subdirectory_entry(const dir_entry_view* entry) {
+    return entry->inode != 0 and entry->file_type == EXT2_D_DTYPE and entry->name != "." and entry->name != "..";
+}
 
-    while (offset < block_size) { // when exceed block size, stop reading
-        fseek(file, block_size * block_number + offset, SEEK_SET);
-        fread(dir_entry, sizeof(ext2_dir_entry), 1, file);
-        if (dir_entry->inode == 0) { // NOTSURE from pdf: As one last thing, a 0 inode value indicates an entry which should be skipped (can be padding or pre-allocation).
-            offset += dir_entry->length;
+// reads the inodes of every subdirectory in the block sorted by their place in the inode tables,
+// so the reads go through the tables front to back instead of jumping between groups in name order,
+// then hints the first block of each of those directories in block order,
+// directories that were already listed are not read again
+void directory_frame_fetch_children(ext2_image* image, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt, directory_frame* frame, const bitmap* visited) {
+    frame->children.clear();
+    frame->next_child = 0;
+    dir_block_reader reader = frame->entries;
+    dir_entry_view entry;
+    while (dir_block_next(&reader, &entry)) {
+        if (!is_subdirectory_entry(&entry)) {
             continue;
         }
-        fseek(file, block_size * block_number + offset + sizeof(ext2_dir_entry), SEEK_SET); // size varies but at least ext2_dir_entry size
-        process_directory_entry(file, super_block, bgdt, dir_entry, depth); 
-        offset += dir_entry->length; // adjust for next entry
+        directory_child child;
+        child.inode = entry.inode;
+        child.table_offset = UINT64_MAX; // out of range numbers are not read at all
+        child.found = false;
+        child.record.pointers[0] = 0; // prefetch sort key of children that are not read
+        child.visited = entry.inode <= super_block->inode_count and bitmap_test(visited, entry.inode);
+        if (entry.inode <= super_block->inode_count and !child.visited) {
+            uint32_t group_num = (entry.inode - 1) / super_block->inodes_per_group;
+            uint32_t index = (entry.inode - 1) % super_block->inodes_per_group;
+            child.table_offset = (uint64_t)bgdt[group_num].inode_table * block_size + (uint64_t)index * super_block->inode_size;
+        }
+        frame->children.push_back(child);
     }
-
-    free(dir_entry);
-}
-
-void print_all_directories(FILE* file, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt, ext2_inode* inode, int depth = 1) {
-    if ((inode->mode & 0xf000) != EXT2_I_DTYPE) {
-        printf("Error: inode is not a directory\n"); 
+    if (frame->children.empty()) {
         return;
     }
 
-    if (depth == 1) { // for root dir only
-        printf("- root/\n");
-        depth++;
+    std::vector<uint32_t>& order = frame->fetch_order;
+    order.resize(frame->children.size());
+    for (uint32_t i = 0; i < order.size(); i++) {
+        order[i] = i;
     }
-
-    // read all direct blocks
-    for (size_t i = 0; i < EXT2_NUM_DIRECT_BLOCKS; i++) {
-        unsigned int block_number = inode->direct_blocks[i];
-        if (block_number == 0) { 
-            break;
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return frame->children[a].table_offset < frame->children[b].table_offset;
+    });
+    for (uint32_t i : order) {
+        directory_child* child = &frame->children[i];
+        if (child->table_offset == UINT64_MAX) {
+            continue;
         }
-        read_block_entries(file, block_number, super_block, bgdt, depth);
+        child->found = read_inode(image, super_block, bgdt, child->inode, &child->record) != NULL;
     }
 
-    // read all indirect blocks
-    // single indirect block
-    if (inode->single_indirect) {
-        unsigned int* indirect_block = new unsigned int[block_size / sizeof(unsigned int)];
-        fseek(file, block_size * inode->single_indirect, SEEK_SET);
-        fread(indirect_block, sizeof(unsigned int), block_size / sizeof(unsigned int), file);
-
-        for (size_t i = 0; i < block_size / sizeof(unsigned int); i++) {
-            unsigned int block_number = indirect_block[i];
-            if (block_number == 0) {
-                break;
-            }
-            read_block_entries(file, block_number, super_block, bgdt, depth);
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return frame->children[a].record.pointers[0] < frame->children[b].record.pointers[0];
+    });
+    for (uint32_t i : order) {
+        const directory_child* child = &frame->children[i];
+        if (child->found and (child->record.mode & 0xf000) == EXT2_I_DTYPE and child->record.pointers[0] != 0) {
+            image_prefetch(image, child->record.pointers[0]);
         }
-
-        free(indirect_block);
     }
+}
 
-    // double indirect block
-    if (inode->double_indirect) {
-        unsigned int* double_indirect_block = new unsigned int[block_size / sizeof(unsigned int)];
-        fseek(file, block_size * inode->double_indirect, SEEK_SET);
-        fread(double_indirect_block, sizeof(unsigned int), block_size / sizeof(unsigned int), file);
-
-        for (size_t i = 0; i < block_size / sizeof(unsigned int); i++) {
-            unsigned int block_number = double_indirect_block[i];
-            if (block_number == 0) {
-                break;
-            }
-
-            unsigned int* indirect_block = new unsigned int[block_size / sizeof(unsigned int)];
-            fseek(file, block_size * block_number, SEEK_SET);
-            fread(indirect_block, sizeof(unsigned int), block_size / sizeof(unsigned int), file);
-
-            for (size_t j = 0; j < block_size / sizeof(unsigned int); j++) {
-                unsigned int block_number = indirect_block[j];
-                if (block_number == 0) {
-                    break;
-                }
-                read_block_entries(file, block_number, super_block, bgdt, depth);
+// loads the next data block of the directory, false once there are no more
+bool directory_frame_next_block(ext2_image* image, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt, directory_frame* frame, const bitmap* visited) {
+    block_map_entry entry;
+    while (block_map_next(&frame->blocks, &entry)) {
+        if (entry.level == 0) { // pointer blocks are handled by the iterator
+            dir_block_open(&frame->entries, image_block(image, entry.physical, frame->scratch.data()), block_size);
+            frame->block = entry.physical;
+            if (options.tree_order == TREE_ORDER_INODE) {
+                directory_frame_fetch_children(image, super_block, bgdt, frame, visited);
             }
-
-            free(indirect_block);
+            return true;
         }
+    }
+    return false;
+}
 
-        free(double_indirect_block);
+void print_all_directories(ext2_image* image, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt, const inode_record* inode, int depth = 1) {
+    if ((inode->mode & 0xf000) != EXT2_I_DTYPE) {
+        printf("Error: inode is not a directory\n"); 
+        return;
     }
 
-    // triple indirect block
-    if (inode->triple_indirect) {
-        unsigned int* triple_indirect_block = new unsigned int[block_size / sizeof(unsigned int)];
-        fseek(file, block_size * inode->triple_indirect, SEEK_SET);
-        fread(triple_indirect_block, sizeof(unsigned int), block_size / sizeof(unsigned int), file);
+    if (depth == 1) { // for root dir only
+        output_string("- root/\n");
+        depth++;
+    }
 
-        for (size_t i = 0; i < block_size / sizeof(unsigned int); i++) {
-            unsigned int block_number = triple_indirect_block[i];
-            if (block_number == 0) {
-                break;
+    // frames are kept when a directory is done so deeper levels reuse their buffers,
+    // memory only grows with the depth of the tree, never with its width
+    std::deque<directory_frame> stack(1);
+    size_t top = 0;
+    directory_frame_open(image, &stack[top], inode, depth);
+
+    // a directory reached twice (corrupted tree with a cycle) is listed once
+    bitmap visited;
+    bitmap_init(&visited, (uint64_t)super_block->inode_count + 1);
+    // an entry naming the root again does not list the whole tree a second time
+    bitmap_set(&visited, EXT2_ROOT_INODE);
+
+    while (true) {
+        directory_frame* frame = &stack[top];
+        // the end of the block, or a corrupt record nothing more can be read past, go to the next block
+        dir_entry_view dir_entry;
+        if (!dir_block_next(&frame->entries, &dir_entry)) {
+            if (frame->entries.corrupt) {
+                fprintf(stderr, "directory block %u: invalid record at offset %u, rest of the block skipped\n", frame->block, frame->entries.offset);
             }
-
-            unsigned int* double_indirect_block = new unsigned int[block_size / sizeof(unsigned int)];
-            fseek(file, block_size * block_number, SEEK_SET);
-            fread(double_indirect_block, sizeof(unsigned int), block_size / sizeof(unsigned int), file);
-
-            for (size_t j = 0; j < block_size / sizeof(unsigned int); j++) {
-                unsigned int block_number = double_indirect_block[j];
-                if (block_number == 0) {
+            if (!directory_frame_next_block(image, super_block, bgdt, frame, &visited)) {
+                block_map_close(&frame->blocks);
+                if (top == 0) {
                     break;
                 }
+                top--;
+            }
+            continue;
+        }
+        if (dir_entry.inode == 0) { // NOTSURE from pdf: As one last thing, a 0 inode value indicates an entry which should be skipped (can be padding or pre-allocation).
+            continue;
+        }
 
-                unsigned int* indirect_block = new unsigned int[block_size / sizeof(unsigned int)];
-                fseek(file, block_size * block_number, SEEK_SET);
-                fread(indirect_block, sizeof(unsigned int), block_size / sizeof(unsigned int), file);
+        // names are printed straight from the block, never copied
+        std::string_view name = dir_entry.name;
+        if (name == "." or name == "..") { // ignore . and ..
+            continue;
+        }
 
-                for (size_t k = 0; k < block_size / sizeof(unsigned int); k++) {
-                    unsigned int block_number = indirect_block[k];
-                    if (block_number == 0) {
-                        break;
-                    }
-                    read_block_entries(file, block_number, super_block, bgdt, depth);
-                }
+        print_indent(frame->depth);
+        if (dir_entry.file_type != EXT2_D_DTYPE) { // file
+            output_write(name.data(), name.size());
+            output_string("\n");
+            continue;
+        }
 
-                free(indirect_block);
+        // directory
+        output_write(name.data(), name.size());
+        output_string("/\n");
+        inode_record record;
+        const inode_record* child;
+        if (options.tree_order == TREE_ORDER_INODE) {
+            // fetched with the rest of the block, in the same entry order
+            const directory_child* fetched = &frame->children[frame->next_child++];
+            if (fetched->visited) { // only directories are marked, so it is one and was listed
+                continue;
             }
-
-            free(double_indirect_block);
+            child = fetched->found ? &fetched->record : NULL;
+        }
+        else {
+            child = read_inode(image, super_block, bgdt, dir_entry.inode, &record);
         }
+        if (child == NULL or (child->mode & 0xf000) != EXT2_I_DTYPE) {
+            printf("Error: inode is not a directory\n");
+            continue;
+        }
+        if (dir_entry.inode > super_block->inode_count or bitmap_test(&visited, dir_entry.inode)) {
+            continue;
+        }
+        bitmap_set(&visited, dir_entry.inode);
 
-        free(triple_indirect_block);
+        int child_depth = frame->depth + 1;
+        top++;
+        if (top == stack.size()) {
+            stack.emplace_back();
+        }
+        directory_frame_open(image, &stack[top], child, child_depth);
     }
+    bitmap_free(&visited);
 }
 
 
-void inode_bitmap_recover(FILE* file, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt, unsigned int inode_bitmap_block, unsigned int inode_table_block, int group_num, bool first_ten_done = false) {
-    auto inode_bitmap_size = (super_block->inodes_per_group + 7) / 8;
+void inode_bitmap_recover(ext2_image* image, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt, unsigned int inode_bitmap_block, unsigned int inode_table_block, int group_num, bool reserved_done = false) {
+    uint32_t inode_bitmap_size = bitmap_size(super_block->inodes_per_group);
     // read inode bitmap
-    fseek(file, block_size * inode_bitmap_block, SEEK_SET);
-    uint8_t* inode_bitmap = new uint8_t[block_size];
-    fread(inode_bitmap, sizeof(uint8_t), block_size, file);
+    bitmap inode_bitmap;
+    bitmap_init(&inode_bitmap, super_block->inodes_per_group, inode_bitmap_size);
+    image_read(image, (uint64_t)block_size * inode_bitmap_block, bitmap_bytes(&inode_bitmap), inode_bitmap_size);
+    set_padding_bits(&inode_bitmap, super_block->inodes_per_group, inode_bitmap_size);
     // printf("recovery starting for group %d\n", group_num);
-    for (unsigned int j = group_num*super_block->inodes_per_group; j < group_num*super_block->inodes_per_group + super_block->inodes_per_group; j++) {
-        // first 10 inodes are reserved for system
-        if (!first_ten_done) {
-            // mark first 10 inodes as used in inode bitmap
-            for (unsigned int i = 0; i < 10; i++) {
-                inode_bitmap[i / 8] |= 1 << (i % 8);
-            }
-            first_ten_done = true;
-        }
-        ext2_inode* inode = read_inode(file, super_block, bgdt, j + 1);
-        // print_inode(inode, j + 1);
-        if (inode->link_count != 0 and inode->deletion_time == 0) {
-            // printf("inode %d is in use\n", j + 1);
-            // mark inode as used in inode bitmap
-            // normalize j to be in range 0 to super_block->inodes_per_group
-            auto normalized_j = j % super_block->inodes_per_group;
-            inode_bitmap[normalized_j / 8] |= 1 << (normalized_j % 8);
-        }
-        free(inode);
+    // inodes below first_inode are reserved for system
+    if (!reserved_done) {
+        // mark them as used in inode bitmap, one mask for the whole run
+        bitmap_set_range(&inode_bitmap, 0, reserved_inode_count(super_block));
     }
+    // mark inodes with links and no deletion time as used, from the model's live bits
+    metadata_mark_live(metadata, image, super_block, bgdt, group_num, &inode_bitmap);
     // //print old inode bitmap 
     // print_inode_bitmap(file, super_block, &bgdt[group_num]);
     // // print new inode bitmap
@@ -263,203 +333,359 @@ void inode_bitmap_recover(FILE* file, ext2_super_block* super_block, ext2_block_
     //     printf("%d ", (inode_bitmap[i / 8] >> (i % 8)) & 1);
     // }
     // write inode bitmap back to disk
-    fseek(file, block_size * inode_bitmap_block, SEEK_SET);
-    fwrite(inode_bitmap, sizeof(uint8_t), block_size, file);
+    image_write(image, (uint64_t)block_size * inode_bitmap_block, bitmap_bytes(&inode_bitmap), inode_bitmap_size);
 
-    free(inode_bitmap);
+    bitmap_free(&inode_bitmap);
 }
 
-void all_inodes_bitmap_recover(FILE* file, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt) {
+void all_inodes_bitmap_recover(ext2_image* image, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt) {
     // for each block group send inode bitmap and inode table to inode_bitmap_recover
-    for (unsigned int i = 0; i < group_count; i++) {
+    // groups only depend on their own inode table so they are recovered concurrently
+    run_parallel(options.threads, group_count, [&](size_t i) {
         unsigned int inode_bitmap_block = bgdt[i].inode_bitmap;
         unsigned int inode_table_block = bgdt[i].inode_table;
-        inode_bitmap_recover(file, super_block, bgdt, inode_bitmap_block, inode_table_block, i, i != 0);
-    }
+        inode_bitmap_recover(image, super_block, bgdt, inode_bitmap_block, inode_table_block, i, i != 0);
+    });
 }
 
-void print_all_inodes(FILE* file, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt) {
+void print_all_inodes(ext2_image* image, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt) {
     for (unsigned int i = 0; i < group_count; i++) {
-        print_inode_bitmap(file, super_block, &bgdt[i]);
-        for (unsigned int j = i*super_block->inodes_per_group; j < i*super_block->inodes_per_group + super_block->inodes_per_group; j++) {
-            ext2_inode* inode = read_inode(file, super_block, bgdt, j + 1);
-            print_inode(inode, j + 1);
-            free(inode);
+        print_inode_bitmap(image, super_block, &bgdt[i]);
+        inode_table_reader reader;
+        if (inode_table_open(&reader, image, super_block, bgdt, i)) {
+            uint32_t j;
+            const ext2_inode* inode;
+            while ((inode = inode_table_next(&reader, &j)) != NULL) {
+                print_inode(inode, i * super_block->inodes_per_group + j + 1);
+            }
         }
+        inode_table_close(&reader);
     }
 }
 
-void print_all_blocks_bitmap(FILE* file, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt) {
+void print_all_blocks_bitmap(ext2_image* image, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt) {
     for (unsigned int i = 0; i < group_count; i++) {
-        print_block_bitmap(file, super_block, &bgdt[i]);
+        print_block_bitmap(image, super_block, &bgdt[i]);
     }
 }
 
-bool is_block_with_ptrs(FILE* file, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt, uint8_t* block, unsigned int block_num, int group_num) {
-    // check if block is ptr block
-    // if not user file and not directory entry then ptr block
-
-    // first 32 bytes same with identifier then user file
-    for (unsigned int i = 0; i < 32; i++) {
-        if (block[i] != identifier[i]) {
-            printf("user file\n");
-            return false;
-        }
+struct block_range {
+    unsigned int group_num;
+    unsigned int first;
+    unsigned int count;
+};
+
+// adds the reads that cover blocks [first, first + count) of the group to the scan
+// a read never starts inside a bitmap byte, so concurrent reads of one group never share one
+void block_bitmap_scan_requests(ext2_super_block* super_block, int group_num, unsigned int first, unsigned int count, size_t chunk_size, std::vector<scan_request>* requests, std::vector<block_range>* ranges) {
+    uint64_t shift = ((uint64_t)group_num * super_block->blocks_per_group + super_block->first_data_block) * block_size;
+    unsigned int chunk_blocks = chunk_size / block_size / 8 * 8;
+    if (chunk_blocks == 0) {
+        chunk_blocks = 8;
     }
-
-    // check if directory entry
-    ext2_dir_entry* dir_entry = (ext2_dir_entry*)block;
-    auto length = dir_entry->length;
-    auto name_length = dir_entry->name_length;
-    auto inode = dir_entry->inode;
-    if (dir_entry->inode < super_block->inode_count) {
-        if (dir_entry->length % 4 == 0 and dir_entry->name_length <= 255) {
-            if (dir_entry->length <= name_length + 8 + 3) {
-                if (dir_entry->file_type <= 7) {
-                    printf("directory entry\n");
-                    return false;
-                }
-            }
+    for (unsigned int i = first; i < first + count; i += chunk_blocks) {
+        unsigned int blocks = first + count - i;
+        if (blocks > chunk_blocks) {
+            blocks = chunk_blocks;
         }
+        requests->push_back({ shift + (uint64_t)block_size * i, (size_t)blocks * block_size });
+        ranges->push_back({ (unsigned int)group_num, i, blocks });
     }
-    
-    return true;
 }
 
-void block_bitmap_recover(FILE* file, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt, unsigned int block_bitmap_block, int group_num) {
-    // printf("recovering block bitmap for group %d\n", group_num);
-    // read block bitmap
-    fseek(file, block_size * block_bitmap_block, SEEK_SET);
-    uint8_t* block_bitmap = new uint8_t[block_size];
-    fread(block_bitmap, sizeof(uint8_t), block_size, file);
+// reads the group's block bitmap (size bytes) into block_bitmap
+// returns true if the group still has to be scanned, false if it is full and already all 1
+bool block_bitmap_load(ext2_image* image, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt, int group_num, bitmap* block_bitmap, uint32_t size) {
+    image_read(image, (uint64_t)block_size * bgdt[group_num].block_bitmap, bitmap_bytes(block_bitmap), size);
     if (bgdt[group_num].free_block_count == 0) {
         // printf("no free block exits mark all 1 group %d\n", group_num);
-        for (unsigned int i = 0; i < block_size; i++) {
-            block_bitmap[i] = 0xff;
-        }
+        bitmap_set_range(block_bitmap, 0, (uint64_t)size * 8);
+        return false;
     }
-    else {
-        printf("free block exits group %d\n", group_num);
-        printf("free block count %d\n", bgdt[group_num].free_block_count);
-        printf("traverse all blocks\n");
-        auto shift = EXT2_BOOT_BLOCK_SIZE + (group_num * super_block->blocks_per_group * block_size);
-        for (unsigned int i = 0; i < super_block->blocks_per_group; i++) {
-            // read a block from start
-            fseek(file, shift + block_size * i, SEEK_SET);
-            uint8_t* block = new uint8_t[block_size];
-            fread(block, sizeof(uint8_t), block_size, file);
-            // check if block is free
-            bool is_free = true;
-            for (unsigned int j = 0; j < block_size; j++) {
-                if (block[j] != 0) {
-                    is_free = false;
-                    printf("block %d is not free\n", i);
-                    break;
-                }
-            }
-            // if block is not free mark it as used in block bitmap
-            if (!is_free) {
-                block_bitmap[i / 8] |= 1 << (i % 8);
+    // blocks past the end of the filesystem in the last group, and the bits after blocks_per_group
+    set_padding_bits(block_bitmap, group_block_count(super_block, group_num), size);
+    return true;
+}
+
+// true if every rebuilt bitmap came from the metadata walk alone, false if any group needed the content scan
+bool all_blocks_bitmap_recover(ext2_image* image, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt) {
+    // rebuild usage from metadata first, reading only inode tables and pointer blocks
+    bitmap reachable;
+    bool walked = options.block_recovery == BLOCK_RECOVERY_WALK;
+    if (walked) {
+        bitmap_init(&reachable, reachability_bit_count(super_block, group_count));
+        mark_metadata_blocks(super_block, bgdt, group_count, &reachable);
+        mark_reachable_blocks(metadata, image, super_block, bgdt, group_count, options.threads, &reachable);
+    }
+
+    uint32_t block_bitmap_size = bitmap_size(super_block->blocks_per_group);
+    std::vector<bitmap> block_bitmaps(group_count);
+    // chunk sized reads of every group that still has to be scanned, so images with
+    // fewer groups than threads still keep every thread and the device busy
+    std::vector<scan_request> requests;
+    std::vector<block_range> ranges;
+    for (unsigned int i = 0; i < group_count; i++) {
+        bitmap_init(&block_bitmaps[i], super_block->blocks_per_group, block_bitmap_size);
+        if (!block_bitmap_load(image, super_block, bgdt, i, &block_bitmaps[i], block_bitmap_size)) {
+            continue;
+        }
+        if (walked) {
+            bitmap_or_range(&block_bitmaps[i], 0, &reachable, (uint64_t)i * super_block->blocks_per_group, super_block->blocks_per_group);
+            // the walk found every used block the descriptor counts, no need to read the contents
+            uint32_t used_blocks = group_block_count(super_block, i) - bgdt[i].free_block_count;
+            if (group_marked_blocks(super_block, &reachable, i) >= used_blocks) {
+                continue;
             }
-            // if block is ptr block then check all ptrs 
-            // if not user file and not directory entry then ptr block
-            // if (is_block_with_ptrs(file, super_block, bgdt, block, i, group_num)) {
-            //     printf("block %d is ptr block\n", i);
-            //     // check all ptrs
-            //     for (unsigned int j = 0; j < block_size / sizeof(unsigned int); j++) {
-            //         unsigned int ptr = ((unsigned int*)block)[j];
-            //         if (ptr != 0) {
-            //             printf("block %d is not free from ptr block\n", ptr);
-            //             block_bitmap[ptr / 8] |= 1 << (ptr % 8);
-            //         }
-
-            //     }
-            // }
-
-
-            free(block);
         }
-
+        block_bitmap_scan_requests(super_block, i, 0, super_block->blocks_per_group, image_scan_chunk_size(image), &requests, &ranges);
     }
 
-    // write block bitmap back to disk
-    fseek(file, block_size * block_bitmap_block, SEEK_SET);
-    fwrite(block_bitmap, sizeof(uint8_t), block_size, file);
+    // mark the non-zero blocks of each chunk as used as soon as it is read, holes have none
+    image_scan(image, requests, options.threads, [&](size_t i, const uint8_t* chunk) {
+        if (chunk == NULL) {
+            return;
+        }
+        mark_nonzero_blocks(chunk, block_size, ranges[i].count, bitmap_bytes(&block_bitmaps[ranges[i].group_num]), ranges[i].first);
+    });
 
-    free(block_bitmap);
+    // write each block bitmap back to disk once
+    for (unsigned int i = 0; i < group_count; i++) {
+        image_write(image, (uint64_t)block_size * bgdt[i].block_bitmap, bitmap_bytes(&block_bitmaps[i]), block_bitmap_size);
+        bitmap_free(&block_bitmaps[i]);
+    }
+    if (walked) {
+        bitmap_free(&reachable);
+    }
+    return walked and requests.empty();
 }
 
-void all_blocks_bitmap_recover(FILE* file, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt) {
-    // for each block group send block bitmap and block table to block_bitmap_recover
+// recomputes the free counts of the descriptors and the super block from the recovered bitmaps
+// only the counts that changed are written
+void update_free_counts(ext2_image* image, ext2_super_block* super_block, ext2_block_group_descriptor* bgdt) {
+    uint64_t bgdt_offset = block_group_descriptor_table_offset(super_block);
+    uint32_t inode_bitmap_size = bitmap_size(super_block->inodes_per_group);
+    uint32_t block_bitmap_size = bitmap_size(super_block->blocks_per_group);
+    uint32_t free_blocks = 0;
+    uint32_t free_inodes = 0;
+    bitmap inode_bitmap;
+    bitmap block_bitmap;
+    bitmap_init(&inode_bitmap, super_block->inodes_per_group, inode_bitmap_size);
+    bitmap_init(&block_bitmap, super_block->blocks_per_group, block_bitmap_size);
     for (unsigned int i = 0; i < group_count; i++) {
-        unsigned int block_bitmap_block = bgdt[i].block_bitmap;
-        // unsigned int block_table_block = bgdt[i].block_table;
-        block_bitmap_recover(file, super_block, bgdt, block_bitmap_block, i);
-        // TODO go from direct pointers to empty blocks and mark them as used
+        image_read(image, (uint64_t)bgdt[i].inode_bitmap * block_size, bitmap_bytes(&inode_bitmap), inode_bitmap_size);
+        uint16_t free_inode_count = super_block->inodes_per_group - bitmap_count(&inode_bitmap, 0, super_block->inodes_per_group);
+        uint32_t blocks = group_block_count(super_block, i);
+        image_read(image, (uint64_t)bgdt[i].block_bitmap * block_size, bitmap_bytes(&block_bitmap), block_bitmap_size);
+        uint16_t free_block_count = blocks - bitmap_count(&block_bitmap, 0, blocks);
+
+        if (bgdt[i].free_inode_count != free_inode_count or bgdt[i].free_block_count != free_block_count) {
+            bgdt[i].free_inode_count = free_inode_count;
+            bgdt[i].free_block_count = free_block_count;
+            image_write(image, bgdt_offset + i * sizeof(ext2_block_group_descriptor), &bgdt[i], sizeof(ext2_block_group_descriptor));
+        }
+        free_blocks += free_block_count;
+        free_inodes += free_inode_count;
+    }
+    bitmap_free(&inode_bitmap);
+    bitmap_free(&block_bitmap);
+
+    if (super_block->free_block_count != free_blocks or super_block->free_inode_count != free_inodes) {
+        super_block->free_block_count = free_blocks;
+        super_block->free_inode_count = free_inodes;
+        // the two counts are next to each other
+        image_write(image, EXT2_SUPER_BLOCK_POSITION + offsetof(ext2_super_block, free_block_count), &super_block->free_block_count, sizeof(uint32_t) * 2);
     }
 }
 
 
 int main(int argc, char* argv[]) {
+    output_init();
+    argc = parse_options(argc, argv, &options);
+    // recext2fs apply-overlay <overlay> <image> [output]
+    if (argc >= 2 and strcmp(argv[1], "apply-overlay") == 0) {
+        if (argc < 4 or argc > 5) {
+            printf("Usage: %s apply-overlay <overlay> <image> [output]\n", argv[0]);
+            return 1;
+        }
+        return overlay_apply(argv[2], argv[3], argc == 5 ? argv[4] : NULL) ? 0 : 1;
+    }
+    // recext2fs diff-bitmaps <image> <reference>, exits with 0 only if every bitmap matches
+    if (argc >= 2 and strcmp(argv[1], "diff-bitmaps") == 0) {
+        if (argc != 4) {
+            printf("Usage: %s diff-bitmaps <image> <reference>\n", argv[0]);
+            return 1;
+        }
+        int64_t differing = diff_image_bitmaps(argv[2], argv[3], stdout);
+        output_flush();
+        return differing == 0 ? 0 : 1;
+    }
+    if (argc < 2) {
+        printf("Usage: %s [--threads N] [--block-recovery walk|content] [--no-pointer-repair] [--no-mmap] [--cache-size MiB] [--metadata-memory MiB] [--tree-order inode|directory] [--queue-depth N] [--io-engine auto|uring|pread] [--direct-io] [--cache-stats] [--dry-run] [--overlay FILE] [--stats FILE] [--identifier HEX] [--identifiers FILE] [--class-map FILE] <image> <identifier bytes...>\n", argv[0]);
+        return 1;
+    }
+
     identifier = parse_identifier(argc, argv);
+    identifier_length = argc - 2;
+
+    signature_index_init(&signatures);
+    signature_index_add(&signatures, identifier, identifier_length);
+    for (const char* text : options.identifiers) {
+        if (!signature_index_add_hex(&signatures, text)) {
+            if (signatures.signatures.size() >= SIGNATURE_MAX) {
+                printf("Error: more than %d identifiers\n", SIGNATURE_MAX);
+            }
+            else {
+                printf("Error: invalid identifier %s\n", text);
+            }
+            delete[] identifier;
+            return 1;
+        }
+    }
+    for (const char* path : options.identifier_files) {
+        if (!signature_index_load(&signatures, path)) {
+            delete[] identifier;
+            return 1;
+        }
+    }
+    signature_index_build(&signatures);
     if (identifier == NULL) { // identifier is invalid
-        free(identifier);
         return 1;
     }
 
     char* file_handle = argv[1];
-    FILE* file = fopen(file_handle, "r+");
-    // if (file == NULL) {
-    //     printf("Error: file not found\n");
-    //     free(identifier);
-    //     return 1;
-    // }
+    stats_phase_begin(STATS_PHASE_LOAD);
+    // with an overlay the image itself is never written
+    ext2_image* image = image_open(file_handle, options.overlay == NULL, options.use_map);
+    if (image == NULL) {
+        delete[] identifier;
+        return 1;
+    }
 
-    ext2_super_block* super_block = read_super_block(file, identifier);
+    ext2_super_block* super_block = read_super_block(image, identifier);
     if (super_block == NULL) {
-        fclose(file);
-        free(identifier);
+        image_close(image);
+        delete[] identifier;
         return 1;
     }
     // print_super_block(super_block);
     block_size = EXT2_UNLOG(super_block->log_block_size);
+    image_set_block_size(image, block_size);
+    image_enable_cache(image, options.cache_size);
+    image_set_scan(image, options.queue_depth, options.scan_engine);
+    if (options.direct_io and !image_enable_direct_io(image, file_handle)) {
+        fprintf(stderr, "O_DIRECT is not supported for %s, scanning through the page cache\n", file_handle);
+    }
+    if (options.overlay != NULL) {
+        if (!image_set_overlay(image, options.overlay)) {
+            image_close(image);
+            delete super_block;
+            delete[] identifier;
+            return 1;
+        }
+        // an earlier run may have updated the counts
+        image_read(image, EXT2_SUPER_BLOCK_POSITION, super_block, sizeof(ext2_super_block));
+    }
 
     group_count = (super_block->inode_count + super_block->inodes_per_group - 1) / super_block->inodes_per_group;
 
     // bgdt is block group descriptor table
     // bgdt is located after super block
-    ext2_block_group_descriptor* bgdt = read_block_group_descriptor_table(file, super_block);
-    // if (bgdt == NULL) {
-    //     fclose(file);
-    //     free(super_block);
-    //     free(identifier);
-    //     return 1;
-    // }
+    ext2_block_group_descriptor* bgdt = read_block_group_descriptor_table(image, super_block);
+    if (bgdt == NULL) {
+        image_close(image);
+        delete super_block;
+        delete[] identifier;
+        return 1;
+    }
+
+    // inode tables are read once here, every pass below works on the model
+    metadata = NULL;
+    if (options.metadata_memory > 0) {
+        metadata = metadata_load(image, super_block, bgdt, group_count, options.threads, options.metadata_memory);
+    }
+
+    stats_phase_end(STATS_PHASE_LOAD);
 
     // debug prints
     // print_block_group_descriptor_table(bgdt, group_count);
-    // print_all_bitmaps(file, super_block, bgdt, group_count);
+    // print_all_bitmaps(image, super_block, bgdt, group_count);
+
+    // one scan that tags every block with its class and owning identifier
+    if (options.class_map != NULL) {
+        stats_phase_begin(STATS_PHASE_CLASSIFY);
+        std::vector<block_class_entry> class_map;
+        classify_all_blocks(image, super_block, &signatures, options.threads, &class_map);
+        if (!write_class_map(options.class_map, class_map)) {
+            printf("Error: failed to write class map %s\n", options.class_map);
+        }
+        print_class_summary(stderr, class_map, &signatures);
+        stats_phase_end(STATS_PHASE_CLASSIFY);
+    }
 
     // part 1 code
-    // print_all_inodes(file, super_block, bgdt);
-    // all_inodes_bitmap_recover(file, super_block, bgdt); 
-    // print_all_inodes(file, super_block, bgdt);
+    // print_all_inodes(image, super_block, bgdt);
+    // rebuilds every inode bitmap from the live inodes of its group
+    stats_phase_begin(STATS_PHASE_INODE_BITMAP);
+    all_inodes_bitmap_recover(image, super_block, bgdt);
+    stats_phase_end(STATS_PHASE_INODE_BITMAP);
+    // print_all_inodes(image, super_block, bgdt);
+
+    // lost pointers have to be back before the block bitmaps are rebuilt from them
+    if (options.repair_pointers) {
+        stats_phase_begin(STATS_PHASE_POINTER_REPAIR);
+        pointer_repair_stats repair_stats;
+        repair_inode_pointers(metadata, image, super_block, bgdt, group_count, options.threads, &signatures, &repair_stats);
+        stats_phase_end(STATS_PHASE_POINTER_REPAIR);
+    }
 
-    print_all_blocks_bitmap(file, super_block, bgdt);
-    all_blocks_bitmap_recover(file, super_block, bgdt);
+    stats_phase_begin(STATS_PHASE_BLOCK_BITMAP);
+    print_all_blocks_bitmap(image, super_block, bgdt);
+    bool exact_bitmaps = all_blocks_bitmap_recover(image, super_block, bgdt);
     printf("after\n");
-    print_all_blocks_bitmap(file, super_block, bgdt);
+    print_all_blocks_bitmap(image, super_block, bgdt);
+    stats_phase_end(STATS_PHASE_BLOCK_BITMAP);
 
     // part 3 code 
     // root inode is always 2
-    ext2_inode* root_inode = read_inode(file, super_block, bgdt, EXT2_ROOT_INODE);
+    stats_phase_begin(STATS_PHASE_TREE);
+    inode_record root_record;
+    const inode_record* root_inode = read_inode(image, super_block, bgdt, EXT2_ROOT_INODE, &root_record);
     // read all directories in root inode
-    // print_all_directories(file, super_block, bgdt, root_inode);
+    if (root_inode == NULL) {
+        printf("Error: failed to read root inode\n");
+    }
+    else {
+        print_all_directories(image, super_block, bgdt, root_inode);
+    }
+    output_flush();
+    stats_phase_end(STATS_PHASE_TREE);
+
+    // everything repaired so far reaches the image here, in one pass
+    stats_phase_begin(STATS_PHASE_WRITE_BACK);
+    // counts recomputed from content scanned bitmaps are only estimates, the original ones are kept
+    if (exact_bitmaps) {
+        update_free_counts(image, super_block, bgdt);
+    }
+    if (!image_commit(image, options.dry_run, options.dry_run ? stderr : NULL)) {
+        printf("Error: failed to write the repaired image\n");
+    }
+    stats_phase_end(STATS_PHASE_WRITE_BACK);
     
-    free(root_inode);
-    free(bgdt);
-    free(super_block);
-    fclose(file);
-    free(identifier);    
+    if (image->hole_bytes > 0) {
+        fprintf(stderr, "skipped %lu bytes in holes of the image\n", (unsigned long)image->hole_bytes);
+    }
+    if (options.cache_stats and image->cache != NULL) {
+        block_cache_print_stats(image->cache, stderr);
+    }
+    if (options.stats != NULL) {
+        stats_write_report(options.stats, file_handle, options.threads);
+    }
+    if (metadata != NULL) {
+        metadata_free(metadata);
+    }
+    delete[] bgdt;
+    delete super_block;
+    image_close(image);
+    delete[] identifier;    
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,202 @@
+#include "stats.h"
+#include "block_class.h"
+#include "arena.h"
+
+#include <time.h>
+#include <sys/resource.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+static_assert(STATS_CLASSIFIED_COUNT == BLOCK_CLASS_COUNT, "one classified counter per block class");
+
+// counters of one thread, read by others only to sum them up
+struct stats_thread {
+    std::atomic<uint64_t> counters[STATS_COUNTER_COUNT];
+    stats_thread();
+    ~stats_thread();
+};
+
+static std::mutex registry_lock;
+static std::vector<stats_thread*> registry; // threads that are alive
+static uint64_t retired[STATS_COUNTER_COUNT]; // what exited threads counted
+
+static thread_local stats_thread local;
+
+stats_thread::stats_thread() {
+    for (int i = 0; i < STATS_COUNTER_COUNT; i++) {
+        counters[i].store(0, std::memory_order_relaxed);
+    }
+    std::lock_guard<std::mutex> guard(registry_lock);
+    registry.push_back(this);
+}
+
+stats_thread::~stats_thread() {
+    std::lock_guard<std::mutex> guard(registry_lock);
+    for (int i = 0; i < STATS_COUNTER_COUNT; i++) {
+        retired[i] += counters[i].load(std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < registry.size(); i++) {
+        if (registry[i] == this) {
+            registry[i] = registry.back();
+            registry.pop_back();
+            break;
+        }
+    }
+}
+
+void stats_add(stats_counter counter, uint64_t value) {
+    // only this thread writes the counter, so load and store instead of a locked add
+    std::atomic<uint64_t>& slot = local.counters[counter];
+    slot.store(slot.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+static void stats_sum(uint64_t* totals) {
+    std::lock_guard<std::mutex> guard(registry_lock);
+    for (int i = 0; i < STATS_COUNTER_COUNT; i++) {
+        totals[i] = retired[i];
+        for (stats_thread* thread : registry) {
+            totals[i] += thread->counters[i].load(std::memory_order_relaxed);
+        }
+    }
+    // operator new cannot count through the thread blocks, creating one allocates
+    totals[STATS_ALLOCATIONS] += allocation_count();
+}
+
+struct stats_time {
+    double wall;
+    double user;
+    double system;
+};
+
+static void stats_now(stats_time* time) {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    time->wall = now.tv_sec + now.tv_nsec / 1e9;
+    // the whole process, so worker threads are included
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    time->user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+    time->system = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+struct stats_record {
+    bool ran;
+    stats_time start;
+    uint64_t start_counters[STATS_COUNTER_COUNT];
+    stats_time spent; // summed over every time the phase ran
+    uint64_t counters[STATS_COUNTER_COUNT];
+};
+
+static stats_record phases[STATS_PHASE_COUNT];
+static stats_time run_start;
+static bool run_started = false;
+
+void stats_phase_begin(stats_phase phase) {
+    stats_record* record = &phases[phase];
+    stats_now(&record->start);
+    stats_sum(record->start_counters);
+    if (!run_started) {
+        run_start = record->start;
+        run_started = true;
+    }
+}
+
+void stats_phase_end(stats_phase phase) {
+    stats_record* record = &phases[phase];
+    stats_time now;
+    stats_now(&now);
+    uint64_t totals[STATS_COUNTER_COUNT];
+    stats_sum(totals);
+    record->ran = true;
+    record->spent.wall += now.wall - record->start.wall;
+    record->spent.user += now.user - record->start.user;
+    record->spent.system += now.system - record->start.system;
+    for (int i = 0; i < STATS_COUNTER_COUNT; i++) {
+        record->counters[i] += totals[i] - record->start_counters[i];
+    }
+}
+
+static const char* phase_names[STATS_PHASE_COUNT] = {
+    "load", "classify", "inode_bitmap", "pointer_repair", "block_bitmap", "tree", "write_back",
+};
+
+static const char* counter_names[STATS_CLASSIFIED] = {
+    "read_calls", "bytes_read", "mapped_bytes", "write_calls", "bytes_written", "sync_calls",
+    "uring_enters", "uring_reads", "uring_bytes", "hole_bytes", "cache_hits", "cache_misses",
+    "metadata_bytes", "allocations",
+};
+
+static const char* class_names[BLOCK_CLASS_COUNT] = { "unknown", "zero", "user_data", "directory", "pointer" };
+
+static void write_counters(FILE* file, const stats_time* time, const uint64_t* counters, const char* indent) {
+    fprintf(file, "%s\"wall_seconds\": %.6f,\n", indent, time->wall);
+    fprintf(file, "%s\"cpu_user_seconds\": %.6f,\n", indent, time->user);
+    fprintf(file, "%s\"cpu_system_seconds\": %.6f,\n", indent, time->system);
+    for (int i = 0; i < STATS_CLASSIFIED; i++) {
+        fprintf(file, "%s\"%s\": %lu,\n", indent, counter_names[i], (unsigned long)counters[i]);
+    }
+    uint64_t syscalls = counters[STATS_READ_CALLS] + counters[STATS_WRITE_CALLS] + counters[STATS_SYNC_CALLS] + counters[STATS_URING_ENTERS];
+    fprintf(file, "%s\"syscalls\": %lu,\n", indent, (unsigned long)syscalls);
+    uint64_t lookups = counters[STATS_CACHE_HITS] + counters[STATS_CACHE_MISSES];
+    fprintf(file, "%s\"cache_hit_rate\": %.4f,\n", indent, lookups == 0 ? 0.0 : (double)counters[STATS_CACHE_HITS] / lookups);
+    fprintf(file, "%s\"classified\": {", indent);
+    for (int i = 0; i < BLOCK_CLASS_COUNT; i++) {
+        fprintf(file, "%s\"%s\": %lu", i == 0 ? " " : ", ", class_names[i], (unsigned long)counters[STATS_CLASSIFIED + i]);
+    }
+    fprintf(file, " }\n");
+}
+
+bool stats_write_report(const char* path, const char* image_path, unsigned int thread_count) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        printf("Error: failed to open stats file %s\n", path);
+        return false;
+    }
+
+    stats_time total = { 0, 0, 0 };
+    if (run_started) {
+        stats_time now;
+        stats_now(&now);
+        total.wall = now.wall - run_start.wall;
+        total.user = now.user - run_start.user;
+        total.system = now.system - run_start.system;
+    }
+    uint64_t totals[STATS_COUNTER_COUNT];
+    stats_sum(totals);
+
+    fprintf(file, "{\n");
+    // the path goes in as it is, escaping only what JSON cannot hold
+    fprintf(file, "  \"image\": \"");
+    for (const char* c = image_path; *c != '\0'; c++) {
+        if (*c == '"' or *c == '\\') {
+            fputc('\\', file);
+        }
+        if ((unsigned char)*c >= 0x20) {
+            fputc(*c, file);
+        }
+    }
+    fprintf(file, "\",\n");
+    fprintf(file, "  \"threads\": %u,\n", thread_count);
+    fprintf(file, "  \"phases\": [\n");
+    bool first = true;
+    for (int i = 0; i < STATS_PHASE_COUNT; i++) {
+        if (!phases[i].ran) {
+            continue;
+        }
+        fprintf(file, "%s    {\n      \"name\": \"%s\",\n", first ? "" : ",\n", phase_names[i]);
+        write_counters(file, &phases[i].spent, phases[i].counters, "      ");
+        fprintf(file, "    }");
+        first = false;
+    }
+    fprintf(file, "\n  ],\n");
+    fprintf(file, "  \"total\": {\n");
+    write_counters(file, &total, totals, "    ");
+    fprintf(file, "  }\n}\n");
+
+    bool ok = fclose(file) == 0;
+    if (!ok) {
+        printf("Error: failed to write stats file %s\n", path);
+    }
+    return ok;
+}
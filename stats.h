@@ -0,0 +1,54 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+// run instrumentation
+// counters live in a per-thread block that only its own thread writes, so counting is a plain add
+// without a lock or a shared cache line. a phase reads the sum over all threads when it begins and ends,
+// workers of run_parallel have joined by then, and keeps the difference together with wall and cpu time
+
+enum stats_phase {
+    STATS_PHASE_LOAD, // super block and BGDT
+    STATS_PHASE_CLASSIFY, // --class-map scan
+    STATS_PHASE_INODE_BITMAP,
+    STATS_PHASE_POINTER_REPAIR,
+    STATS_PHASE_BLOCK_BITMAP,
+    STATS_PHASE_TREE,
+    STATS_PHASE_WRITE_BACK,
+};
+#define STATS_PHASE_COUNT 7
+
+enum stats_counter {
+    STATS_READ_CALLS, // pread
+    STATS_BYTES_READ, // bytes those returned
+    STATS_MAPPED_BYTES, // bytes handed out as views of the mapping
+    STATS_WRITE_CALLS, // pwrite, pwritev, copy_file_range
+    STATS_BYTES_WRITTEN,
+    STATS_SYNC_CALLS,
+    STATS_URING_ENTERS, // io_uring_enter system calls
+    STATS_URING_READS, // reads completed through io_uring
+    STATS_URING_BYTES,
+    STATS_HOLE_BYTES, // bytes a scan skipped because they lie in holes
+    STATS_CACHE_HITS,
+    STATS_CACHE_MISSES,
+    STATS_METADATA_BYTES, // bytes the metadata model holds
+    STATS_ALLOCATIONS, // heap allocations (operator new, std containers included, and the scan buffers), process wide rather than per thread
+    STATS_CLASSIFIED, // STATS_CLASSIFIED + block_class, blocks classified per class
+};
+#define STATS_CLASSIFIED_COUNT 5
+#define STATS_COUNTER_COUNT (STATS_CLASSIFIED + STATS_CLASSIFIED_COUNT)
+
+// adds value to a counter of the calling thread
+void stats_add(stats_counter counter, uint64_t value);
+
+void stats_phase_begin(stats_phase phase);
+
+void stats_phase_end(stats_phase phase);
+
+// writes every phase and the totals as JSON, false if the file cannot be written
+bool stats_write_report(const char* path, const char* image_path, unsigned int thread_count);
+
+#endif // STATS_H
@@ -0,0 +1,35 @@
+#include "thread_pool.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+void run_parallel(unsigned int thread_count, size_t task_count, const std::function<void(size_t)>& task) {
+    if (thread_count > task_count) {
+        thread_count = task_count;
+    }
+    if (thread_count <= 1) {
+        for (size_t i = 0; i < task_count; i++) {
+            task(i);
+        }
+        return;
+    }
+
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        size_t i;
+        while ((i = next.fetch_add(1)) < task_count) {
+            task(i);
+        }
+    };
+
+    // the calling thread is one of the workers
+    std::vector<std::thread> workers;
+    for (unsigned int i = 1; i < thread_count; i++) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : workers) {
+        thread.join();
+    }
+}
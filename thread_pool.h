@@ -0,0 +1,12 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stdlib.h>
+#include <functional>
+
+// runs task(0) ... task(task_count - 1) on thread_count workers
+// workers pull the next task index from a shared counter so uneven tasks balance out
+// with one thread (or one task) everything runs on the calling thread in order
+void run_parallel(unsigned int thread_count, size_t task_count, const std::function<void(size_t)>& task);
+
+#endif // THREAD_POOL_H
@@ -0,0 +1,143 @@
+#include "zero_scan.h"
+#include "arena.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ZERO_SCAN_X86
+#endif
+
+typedef bool (*zero_kernel)(const uint8_t* data, size_t length);
+
+static bool is_zero_scalar(const uint8_t* data, size_t length) {
+    size_t i = 0;
+    // or together 4 words at a time and only test once per 32 bytes
+    for (; i + 32 <= length; i += 32) {
+        uint64_t words[4];
+        memcpy(words, data + i, sizeof(words));
+        if ((words[0] | words[1] | words[2] | words[3]) != 0) {
+            return false;
+        }
+    }
+    for (; i < length; i++) {
+        if (data[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#ifdef ZERO_SCAN_X86
+__attribute__((target("sse2")))
+static bool is_zero_sse2(const uint8_t* data, size_t length) {
+    size_t i = 0;
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 64 <= length; i += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(data + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*)(data + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i*)(data + i + 48));
+        __m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, zero)) != 0xffff) {
+            return false;
+        }
+    }
+    return is_zero_scalar(data + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static bool is_zero_avx2(const uint8_t* data, size_t length) {
+    size_t i = 0;
+    for (; i + 128 <= length; i += 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(data + i + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i*)(data + i + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(data + i + 96));
+        __m256i any = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+        if (!_mm256_testz_si256(any, any)) {
+            return false;
+        }
+    }
+    return is_zero_scalar(data + i, length - i);
+}
+
+__attribute__((target("avx512f")))
+static bool is_zero_avx512(const uint8_t* data, size_t length) {
+    size_t i = 0;
+    for (; i + 256 <= length; i += 256) {
+        __m512i a = _mm512_loadu_si512((const void*)(data + i));
+        __m512i b = _mm512_loadu_si512((const void*)(data + i + 64));
+        __m512i c = _mm512_loadu_si512((const void*)(data + i + 128));
+        __m512i d = _mm512_loadu_si512((const void*)(data + i + 192));
+        __m512i any = _mm512_or_si512(_mm512_or_si512(a, b), _mm512_or_si512(c, d));
+        if (_mm512_test_epi64_mask(any, any) != 0) {
+            return false;
+        }
+    }
+    return is_zero_scalar(data + i, length - i);
+}
+#endif
+
+struct zero_kernel_choice {
+    zero_kernel kernel;
+    const char* name;
+};
+
+static zero_kernel_choice pick_zero_kernel() {
+#ifdef ZERO_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return { is_zero_avx512, "avx512" };
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return { is_zero_avx2, "avx2" };
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return { is_zero_sse2, "sse2" };
+    }
+#endif
+    return { is_zero_scalar, "scalar" };
+}
+
+static const zero_kernel_choice& zero_kernel_selected() {
+    static const zero_kernel_choice choice = pick_zero_kernel();
+    return choice;
+}
+
+bool is_zero(const uint8_t* data, size_t length) {
+    return zero_kernel_selected().kernel(data, length);
+}
+
+const char* zero_scan_kernel_name() {
+    return zero_kernel_selected().name;
+}
+
+void mark_nonzero_blocks(const uint8_t* buffer, uint32_t block_size, uint32_t block_count, uint8_t* bitmap, uint32_t first_bit) {
+    zero_kernel kernel = zero_kernel_selected().kernel;
+    for (uint32_t i = 0; i < block_count; i++) {
+        if (!kernel(buffer + (size_t)i * block_size, block_size)) {
+            uint32_t bit = first_bit + i;
+            bitmap[bit / 8] |= 1 << (bit % 8);
+        }
+    }
+}
+
+bool scan_buffer_alloc(scan_buffer* buffer, size_t size) {
+    // aligned_alloc wants a multiple of the alignment
+    size = (size + ZERO_SCAN_ALIGNMENT - 1) / ZERO_SCAN_ALIGNMENT * ZERO_SCAN_ALIGNMENT;
+    buffer->data = (uint8_t*)counted_aligned_alloc(ZERO_SCAN_ALIGNMENT, size);
+    buffer->size = buffer->data == NULL ? 0 : size;
+    if (buffer->data == NULL) {
+        printf("Error: failed to allocate scan buffer\n");
+        return false;
+    }
+    return true;
+}
+
+void scan_buffer_free(scan_buffer* buffer) {
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->size = 0;
+}
@@ -0,0 +1,31 @@
+#ifndef ZERO_SCAN_H
+#define ZERO_SCAN_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+// bytes read per step of the block content scan
+#define ZERO_SCAN_CHUNK_SIZE (1U << 20)
+#define ZERO_SCAN_ALIGNMENT 64
+
+// true if all length bytes are zero
+// uses the widest of AVX-512, AVX2, SSE2 the cpu supports, picked once at runtime, or a scalar loop
+bool is_zero(const uint8_t* data, size_t length);
+
+// name of the kernel is_zero picked, for diagnostics
+const char* zero_scan_kernel_name();
+
+// for each of the block_count blocks in buffer that is not all zero sets bit (first_bit + i) in bitmap
+void mark_nonzero_blocks(const uint8_t* buffer, uint32_t block_size, uint32_t block_count, uint8_t* bitmap, uint32_t first_bit);
+
+// reusable aligned buffer for streaming block contents, one per scanning thread
+struct scan_buffer {
+    uint8_t* data;
+    size_t size;
+};
+
+bool scan_buffer_alloc(scan_buffer* buffer, size_t size);
+
+void scan_buffer_free(scan_buffer* buffer);
+
+#endif // ZERO_SCAN_H